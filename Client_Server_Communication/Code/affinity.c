@@ -0,0 +1,214 @@
+// affinity.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+#define MAX_NODES 64
+
+int placement_parse(struct placement *p, const char *spec) {
+    const char *s = spec;
+
+    p->count = 0;
+    if (strcmp(spec, "auto") == 0) {
+        cpu_set_t set;
+
+        if (sched_getaffinity(0, sizeof(set), &set) < 0)
+            return -1;
+        for (int c = 0; c < CPU_SETSIZE && c < AFFINITY_MAX_CPUS; c++)
+            if (CPU_ISSET(c, &set))
+                p->cpus[p->count++] = c;
+        return p->count ? 0 : -1;
+    }
+
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        if (hi >= AFFINITY_MAX_CPUS || p->count + (hi - lo) >= AFFINITY_MAX_CPUS)
+            return -1;
+        for (long c = lo; c <= hi; c++)
+            p->cpus[p->count++] = (int)c;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        s = end;
+    }
+    return p->count ? 0 : -1;
+}
+
+int cpu_node(int cpu) {
+    char path[64];
+    struct dirent *e;
+    DIR *d;
+    int node = 0;
+
+    // Each CPU's sysfs directory links to its node as "node<N>".
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if (!(d = opendir(path)))
+        return 0;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && isdigit((unsigned char)e->d_name[4])) {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+void mem_prefer_node(int node) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+    // Failure just leaves the default, first-touch, policy in place.
+    if (node < 0 || node >= MAX_NODES) {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        return;
+    }
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES + 1);
+}
+
+void affinity_enter(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity failed");
+    mem_prefer_node(cpu_node(cpu));
+}
+
+// The CPUs as a hex mask in the comma-separated 32-bit groups of sysfs.
+static void cpu_mask_string(const struct placement *p, char *buf, size_t size) {
+    uint32_t words[AFFINITY_MAX_CPUS / 32] = { 0 };
+    int top = 0;
+    size_t len = 0;
+
+    for (int i = 0; i < p->count; i++) {
+        int c = p->cpus[i];
+        words[c / 32] |= 1u << (c % 32);
+        if (c / 32 > top)
+            top = c / 32;
+    }
+    for (int w = top; w >= 0 && len < size; w--)
+        len += snprintf(buf + len, size - len, w == top ? "%x" : ",%08x", words[w]);
+}
+
+static int write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+
+    if (!f)
+        return -1;
+    fputs(text, f);
+    return fclose(f);   // a rejected write shows up here
+}
+
+// True if the /proc/interrupts line names dev as a whole word, as in
+// "eth0" or "eth0-TxRx-3" but not "eth01".
+static int names_device(const char *line, const char *dev) {
+    size_t n = strlen(dev);
+
+    for (const char *s = strstr(line, dev); s; s = strstr(s + 1, dev)) {
+        if ((s == line || !isalnum((unsigned char)s[-1])) && !isalnum((unsigned char)s[n]))
+            return 1;
+    }
+    return 0;
+}
+
+void steer_rx(const char *dev, const struct placement *p) {
+    char path[PATH_MAX], line[4096], cpu[16];
+    char mask[AFFINITY_MAX_CPUS / 4 + AFFINITY_MAX_CPUS / 32 + 1];
+    int irqs = 0, queues = 0, failed = 0;
+    glob_t g;
+    FILE *f;
+
+    if (!p->count)
+        return;
+    cpu_mask_string(p, mask, sizeof(mask));
+
+    // RPS: which CPUs do protocol processing for each receive queue.
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues/rx-*/rps_cpus", dev);
+    if (glob(path, 0, NULL, &g) == 0) {
+        for (size_t i = 0; i < g.gl_pathc; i++) {
+            if (write_file(g.gl_pathv[i], mask) == 0)
+                queues++;
+            else
+                failed++;
+        }
+        globfree(&g);
+    }
+
+    // Interrupts: the device's vectors, one per CPU in turn, so each
+    // queue's packets arrive where a worker is waiting for them.
+    if ((f = fopen("/proc/interrupts", "r")) != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            char *end;
+            long irq = strtol(line, &end, 10);
+
+            if (*end != ':' || end == line || !names_device(end, dev))
+                continue;
+            snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+            snprintf(cpu, sizeof(cpu), "%d", placement_cpu(p, irqs + failed));
+            if (write_file(path, cpu) == 0)
+                irqs++;
+            else
+                failed++;
+        }
+        fclose(f);
+    }
+
+    printf("Steered %d interrupts and %d RPS queues of %s onto CPU mask %s\n",
+           irqs, queues, dev, mask);
+    if (failed)
+        fprintf(stderr, "%s: %d interrupt or RPS settings could not be changed\n", dev, failed);
+}
+
+int steer_reuseport(int fd, const struct placement *p, int n) {
+    struct sock_filter code[2 * n + 3];
+    struct sock_fprog prog;
+    int k = 0;
+
+    if (!p->count || n < 2)
+        return 0;
+
+    // A = the CPU that received the connection. Each worker pinned to it
+    // is tried in order; an unpinned CPU falls back to A % n. The index
+    // selects a listener by the order the group's sockets were bound.
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++) {
+        code[k++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 (unsigned)placement_cpu(p, i), 0, 1);
+        code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned)i);
+    }
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned)n);
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = (unsigned short)k;
+    prog.filter = code;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
@@ -0,0 +1,50 @@
+// affinity.h
+// Worker placement: pinning loop threads to CPUs and keeping each one's
+// memory and network traffic on its own NUMA node, so a connection's
+// packets, socket and state are never touched from the other socket of
+// a dual-socket machine. There is no libnuma dependency: node topology
+// comes from sysfs and memory policy from the raw system call.
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_MAX_CPUS 1024
+
+// The CPUs worker threads are pinned to, in order: worker i runs on
+// cpus[i % count]. count == 0 means no pinning.
+struct placement {
+    int count;
+    int cpus[AFFINITY_MAX_CPUS];
+};
+
+// Parse a CPU list such as "0-3,8,10-11", or "auto" for every CPU this
+// process may run on. Returns 0, or -1 if the list is malformed.
+int placement_parse(struct placement *p, const char *spec);
+
+// CPU for worker i, or -1 when not pinning.
+static inline int placement_cpu(const struct placement *p, int i) {
+    return p->count ? p->cpus[i % p->count] : -1;
+}
+
+// NUMA node of a CPU; 0 on machines without NUMA information.
+int cpu_node(int cpu);
+
+// Pin the calling thread to cpu and take its future allocations from
+// that CPU's node. Does nothing for cpu < 0.
+void affinity_enter(int cpu);
+
+// Take the calling thread's allocations from node until called again;
+// -1 restores the default policy. Lets one thread set up memory that
+// another, pinned elsewhere, will use.
+void mem_prefer_node(int node);
+
+// Steer the receive interrupts and RPS of network device dev onto the
+// placement's CPUs. Best effort: it needs root, and reports what it
+// could not change.
+void steer_rx(const char *dev, const struct placement *p);
+
+// fd is the first of n SO_REUSEPORT listeners, bound in worker order.
+// Hand each new connection to the listener of the worker pinned to the
+// CPU that received it, instead of hashing. Returns 0, or -1 with errno.
+int steer_reuseport(int fd, const struct placement *p, int n);
+
+#endif
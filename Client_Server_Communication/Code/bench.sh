@@ -0,0 +1,114 @@
+#!/bin/sh
+# bench.sh - compare the server models under the client's load mode.
+#
+# Each model is started in echo mode and driven by `client -n` at every
+# connection count in turn. One CSV row per run records throughput, echo
+# latency, peak RSS and context switches (summed over every server thread).
+# The event server models (epoll, uring, select) also run with -s, and the
+# row records the system calls per message from its per-second stats,
+# weighted by each second's message count; the other servers have no such
+# count, so their column is left empty.
+#
+# With BENCH_MODE=storm each run is instead a reconnect storm (`client -S`):
+# every connection opens at once and the row records how long until all
+# of them had their first frame echoed.
+#
+# Runs go over TCP unless BENCH_TRANSPORT names another client -X
+# transport (auto, unix, shm); storm runs are always TCP.
+#
+# usage: ./bench.sh [output.csv]
+# Environment: BENCH_MODE, BENCH_MODELS, BENCH_CONNS, BENCH_SECS,
+#              BENCH_THREADS, BENCH_SIZE, BENCH_TRANSPORT
+
+OUT=${1:-bench.csv}
+MODE=${BENCH_MODE:-load}
+MODELS=${BENCH_MODELS:-"thread epoll uring select coro"}
+if [ "$MODE" = storm ]; then
+    CONNS=${BENCH_CONNS:-50000}
+    SECS=${BENCH_SECS:-30}
+else
+    CONNS=${BENCH_CONNS:-"10 100 1000 10000"}
+    SECS=${BENCH_SECS:-5}
+fi
+THREADS=${BENCH_THREADS:-4}
+SIZE=${BENCH_SIZE:-64}
+TRANSPORT=${BENCH_TRANSPORT:-tcp}
+
+# 10k connections need more descriptors than the usual soft limit.
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+server_cmd() {
+    case $1 in
+    thread) echo "./server_thread -e -q" ;;
+    epoll)  echo "./server_event -m epoll -e -q -s" ;;
+    uring)  echo "./server_event -m uring -e -q -s" ;;
+    select) echo "./server_event -m select -e -q -s" ;;
+    coro)   echo "./server_coro -e -q" ;;
+    *)      echo "unknown model: $1" >&2; exit 1 ;;
+    esac
+}
+
+# Line-buffer the server's output, so the stats it printed are in the log
+# when it is killed.
+LINEBUF=
+command -v stdbuf > /dev/null && LINEBUF="stdbuf -oL"
+LOG=${TMPDIR:-/tmp}/bench-server.$$
+trap 'rm -f "$LOG"' EXIT
+
+# Sum a field of /proc/<pid>/task/*/status over every thread.
+task_sum() {
+    cat /proc/"$1"/task/*/status 2>/dev/null | awk -v f="$2:" '$1 == f { s += $2 } END { print s + 0 }'
+}
+
+if [ "$MODE" = storm ]; then
+    echo "model,conns,reestablished,failed,connect_p99_ms,echo_p99_ms,all_back_ms,rss_kb,ctx_switches,syscalls_per_msg" > "$OUT"
+else
+    echo "model,conns,msgs_per_sec,p50_us,p99_us,p999_us,max_us,errors,rss_kb,ctx_switches,syscalls_per_msg" > "$OUT"
+fi
+
+for model in $MODELS; do
+    cmd=$(server_cmd "$model") || exit 1
+    for n in $CONNS; do
+        # The previous server's listener can outlive it briefly (io_uring
+        # releases its files asynchronously), so retry until bind succeeds.
+        for try in 1 2 3 4 5 6 7 8 9 10; do
+            $LINEBUF $cmd < /dev/null > "$LOG" 2>&1 &
+            pid=$!
+            sleep 1
+            kill -0 $pid 2>/dev/null && break
+        done
+
+        t=$THREADS
+        [ "$n" -lt "$t" ] && t=$n
+        if [ "$MODE" = storm ]; then
+            res=$(./client -S -n "$n" -t "$t" -d "$SECS" -s "$SIZE" 127.0.0.1)
+        else
+            res=$(./client -X "$TRANSPORT" -n "$n" -t "$t" -d "$SECS" -s "$SIZE" 127.0.0.1)
+        fi
+
+        rss=$(awk '$1 == "VmHWM:" { print $2 }' /proc/$pid/status 2>/dev/null)
+        csw=$(( $(task_sum $pid voluntary_ctxt_switches) + $(task_sum $pid nonvoluntary_ctxt_switches) ))
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+        # "[stats] <msgs> msgs/sec, <calls> syscalls/msg", once a second.
+        scm=$(awk '$1 == "[stats]" { m += $2; c += $2 * $4 }
+                   END { if (m) printf "%.2f", c / m }' "$LOG")
+
+        echo "$res" | awk -v mode="$MODE" -v model="$model" -v n="$n" -v rss="${rss:-0}" -v csw="$csw" -v scm="$scm" '
+            /^sent/       { errors = $NF }
+            /^throughput/ { rate = $2 }
+            /^latency/    { p50 = $4; p99 = $6; p999 = $8; max = $10 }
+            /^re-established/ { back = $2 + 0; failed = $4 }
+            /^connect/    { cp99 = $6 }
+            /^echo/       { ep99 = $6 }
+            /^all back/   { total = $4 }
+            END {
+                if (mode == "storm")
+                    printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
+                           model, n, back, failed, cp99, ep99, total, rss, csw, scm
+                else
+                    printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
+                           model, n, rate, p50, p99, p999, max, errors, rss, csw, scm
+            }' | tee -a "$OUT"
+    done
+done
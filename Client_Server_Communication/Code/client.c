@@ -3,88 +3,1457 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include "framing.h"
+#include "outq.h"
+#include "hist.h"
+#include "local.h"
+#include "tune.h"
+#include "timer.h"
 
 #define SERVER_PORT 5432
-#define MAX_LINE 256
+#define RECV_BUF 65536
+#define MAX_THREADS 256   // load mode: upper bound for -t
+#define LOAD_EVENTS 256   // load mode: events harvested per epoll_wait
+#define DRAIN_NS 2000000000ULL  // load and bulk modes: wait this long for late echoes
+#define STORM_SOURCES 64  // storm mode: loopback source addresses to spread over
+#define BULK_CHUNK (1 << 20)  // bulk mode: input read per call, and the longest message
+#define BULK_IOV 1024     // bulk mode: iovecs per writev (two per message)
+#define CONNECT_TIMEOUT 10.0    // seconds to resolve the host and connect (-T)
+#define CONNECT_DELAY_MS 250    // head start of each address over the next
+#define MAX_ADDRS 64      // resolved addresses raced at most
+
+// Growable byte buffer for the line being typed and the frames queued to send.
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+
+static int buffer_append(struct buffer *b, const void *data, size_t n)
+{
+  if (b->len + n > b->cap) {
+    size_t ncap = b->cap ? b->cap : 4096;
+    char *nd;
+    while (ncap < b->len + n)
+      ncap *= 2;
+    if (!(nd = realloc(b->data, ncap)))
+      return -1;
+    b->data = nd;
+    b->cap = ncap;
+  }
+  memcpy(b->data + b->len, data, n);
+  b->len += n;
+  return 0;
+}
+
+// Queue one line as a frame; every line read together leaves in one send.
+static int queue_frame(struct buffer *out, const char *msg, size_t len)
+{
+  char hdr[FRAME_HDR];
+
+  frame_put_header(hdr, (uint32_t)len);
+  if (buffer_append(out, hdr, FRAME_HDR) < 0 || buffer_append(out, msg, len) < 0)
+    return -1;
+  return 0;
+}
+
+static int send_all(int s, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(s, data, len, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int print_message(void *ctx, const char *msg, size_t len)
+{
+  // An empty frame is a keepalive ping; answer it so a server with an
+  // idle timeout knows we are still here. Nobody pings over shared
+  // memory, where ctx is NULL.
+  if (len == 0) {
+    char pong[FRAME_HDR];
+    frame_put_header(pong, 0);
+    return ctx ? send_all(*(int *)ctx, pong, FRAME_HDR) : 0;
+  }
+  printf("%.*s\n", (int)len, msg);
+  return 0;
+}
+
+// How to reach the server (-X). Auto uses the local transports when the
+// server is on this host: shared memory for a load run in which every
+// connection has a thread to itself, otherwise its UNIX socket. A chat
+// session never uses shared memory by default, since a shared-memory
+// client is not sent the operator's lines.
+enum transport { TRANSPORT_AUTO, TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_SHM, TRANSPORTS };
+
+static const char *const transport_names[TRANSPORTS] = { "auto", "tcp", "unix", "shm" };
+
+// Load-generator mode (-n). Each thread drives its share of the
+// connections from one epoll loop and the server echoes every frame
+// back (run it with -e -q). Every payload starts with the time it was
+// due to be sent, so the echo gives the round-trip latency.
+//
+// With -r the rate is fixed (open loop): messages are stamped with their
+// scheduled time rather than the time they actually left, so a server
+// stall shows up as latency instead of silently lowering the offered
+// load. Without -r each connection keeps -w messages in flight (closed
+// loop) and the result is the maximum sustainable throughput.
+struct load_opts {
+  int conns, threads, size, secs, window;
+  double rate;              // msgs/sec over all connections; 0 = closed loop
+  int zerocopy;             // writes of this many bytes or more use MSG_ZEROCOPY
+  enum tune_profile profile;
+  int fastopen;             // storm mode: connect with TCP Fast Open
+  enum transport transport;
+  const char *local_path;   // the server's UNIX socket (-U); NULL = the default
+  double connect_timeout;   // seconds (-T)
+  struct sockaddr_storage addr;  // the server address that won the connect race
+  socklen_t addrlen;
+};
+
+struct load_conn {
+  int fd;
+  struct shm_chan *shm;     // shared-memory transport; fd is then its socket
+  struct frame_parser rx;
+  struct outq tx;
+  int state;                // storm mode: 0 connecting, 1 waiting for echo, 2 back
+};
+
+struct load_thread {
+  pthread_t tid;
+  struct load_conn *conns;
+  int count, live;
+  char *payload;
+  struct hist lat;          // nanoseconds
+  unsigned long sent, received, errors;
+  int sending;
+};
+
+static struct load_opts opts = { 0, 1, 64, 10, 1, 0, .connect_timeout = CONNECT_TIMEOUT };
+static pthread_barrier_t load_start;
+static uint64_t load_end;
+
+// Generous limits: in open loop a lagging server backs messages up here,
+// which is exactly the queueing delay the histogram should see.
+static const struct outq_limits load_limits = { 256 << 20, 128 << 20, OUTQ_CLOSE };
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int load_send(struct load_thread *t, struct load_conn *c, uint64_t stamp)
+{
+  struct msgbuf *b;
+  int rc;
+
+  memcpy(t->payload, &stamp, sizeof(stamp));
+  if (c->shm) {
+    if (shm_send_frame(c->shm, t->payload, opts.size) < 0)
+      return -1;
+    t->sent++;
+    return 0;
+  }
+  if (!(b = msgbuf_frame(t->payload, opts.size)))
+    return -1;
+  rc = outq_send(&c->tx, c->fd, b, &load_limits);
+  msgbuf_unref(b);
+  if (rc >= 0)
+    t->sent++;
+  return rc < 0 ? -1 : 0;
+}
+
+static void load_close(struct load_thread *t, struct load_conn *c)
+{
+  if (c->fd < 0)
+    return;
+  frame_parser_reset(&c->rx);
+  outq_clear(&c->tx, c->shm ? -1 : c->fd);
+  if (c->shm) {
+    shm_close(c->shm);
+    free(c->shm);
+    c->shm = NULL;
+  } else {
+    close(c->fd);
+  }
+  c->fd = -1;
+  t->live--;
+}
+
+struct echo_ctx {
+  struct load_thread *t;
+  struct load_conn *c;
+};
+
+// Called for every echoed frame. Errors are returned rather than acted
+// on, since the parser still owns the connection's receive buffer.
+static int on_echo(void *arg, const char *msg, size_t len)
+{
+  struct echo_ctx *ctx = arg;
+  uint64_t stamp, now = now_ns();
+
+  if (len < sizeof(stamp))
+    return 0;
+  memcpy(&stamp, msg, sizeof(stamp));
+  hist_record(&ctx->t->lat, now > stamp ? now - stamp : 0);
+  ctx->t->received++;
+  if (opts.rate == 0 && ctx->t->sending)
+    return load_send(ctx->t, ctx->c, now);
+  return 0;
+}
+
+static int load_read(struct load_thread *t, struct load_conn *c)
+{
+  char buf[RECV_BUF];
+  struct echo_ctx ctx = { t, c };
+  int rc;
+
+  // Closed loop answers every echo; send those replies together.
+  tune_cork(c->fd, opts.profile, 1);
+  while (1) {
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      if (frame_feed(&c->rx, buf, n, on_echo, &ctx) != 0) {
+        rc = -1;
+        break;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    rc = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    break;
+  }
+  tune_cork(c->fd, opts.profile, 0);
+  tune_after_read(c->fd, opts.profile);
+  return rc;
+}
+
+// Name resolution runs on a thread of its own, so a resolver that hangs
+// costs at most the connect timeout: the main thread stops waiting and
+// leaves the thread to clean up after itself.
+struct resolve_req {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  const char *host;
+  struct addrinfo *res;
+  int err, finished, abandoned;
+};
+
+static void *resolve_thread(void *arg)
+{
+  struct resolve_req *req = arg;
+  struct addrinfo hints = { 0 };
+  char port[8];
+  int abandoned;
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  snprintf(port, sizeof(port), "%d", SERVER_PORT);
+  req->err = getaddrinfo(req->host, port, &hints, &req->res);
+  if (req->err == EAI_SYSTEM)
+    req->err = EAI_FAIL;    // errno is this thread's
+
+  pthread_mutex_lock(&req->lock);
+  req->finished = 1;
+  abandoned = req->abandoned;
+  pthread_cond_signal(&req->done);
+  pthread_mutex_unlock(&req->lock);
+  if (abandoned) {
+    if (req->err == 0)
+      freeaddrinfo(req->res);
+    free(req);
+  }
+  return NULL;
+}
+
+// Resolve host to its IPv4 and IPv6 addresses by deadline (CLOCK_MONOTONIC
+// ns). Returns 0, or an EAI_ code: EAI_SYSTEM with errno ETIMEDOUT if
+// time ran out.
+static int resolve(const char *host, uint64_t deadline, struct addrinfo **res)
+{
+  struct resolve_req *req = calloc(1, sizeof(*req));
+  pthread_condattr_t attr;
+  struct timespec ts = { deadline / 1000000000ULL, deadline % 1000000000ULL };
+  pthread_t tid;
+  int err;
+
+  if (!req)
+    return EAI_MEMORY;
+  req->host = host;
+  pthread_mutex_init(&req->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&req->done, &attr);
+  pthread_condattr_destroy(&attr);
+  if ((errno = pthread_create(&tid, NULL, resolve_thread, req)) != 0) {
+    free(req);
+    return EAI_SYSTEM;
+  }
+  pthread_detach(tid);
+
+  pthread_mutex_lock(&req->lock);
+  while (!req->finished && pthread_cond_timedwait(&req->done, &req->lock, &ts) != ETIMEDOUT)
+    ;
+  if (!req->finished) {
+    req->abandoned = 1;
+    pthread_mutex_unlock(&req->lock);
+    errno = ETIMEDOUT;
+    return EAI_SYSTEM;
+  }
+  pthread_mutex_unlock(&req->lock);
+  err = req->err;
+  *res = req->res;
+  free(req);
+  return err;
+}
+
+static int is_loopback(const struct sockaddr *sa)
+{
+  if (sa->sa_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *)sa)->sin_addr.s_addr) >> 24) == 127;
+  if (sa->sa_family == AF_INET6) {
+    const struct in6_addr *a = &((struct sockaddr_in6 *)sa)->sin6_addr;
+    return IN6_IS_ADDR_LOOPBACK(a) ||
+           (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+  }
+  return 0;
+}
+
+// Connect to whichever of the resolved addresses answers first, Happy
+// Eyeballs style (RFC 8305). Families alternate, starting with the one
+// the resolver put first, and each attempt gets CONNECT_DELAY_MS to itself
+// before the next one starts alongside it; an attempt that fails hands
+// over at once. An unreachable first address therefore costs a quarter
+// of a second instead of a full TCP connect timeout. The winner is kept
+// in opts.addr for any further connections. Returns a blocking socket,
+// or -1 with errno set (ETIMEDOUT once deadline passes).
+static int race_connect(const struct addrinfo *res, uint64_t deadline)
+{
+  const struct addrinfo *order[MAX_ADDRS], *same[MAX_ADDRS], *other[MAX_ADDRS], *ai;
+  const struct addrinfo *pending[MAX_ADDRS];
+  struct pollfd pfd[MAX_ADDRS];
+  int n = 0, ns = 0, no = 0, next = 0, live = 0, winner = -1, err = ECONNREFUSED;
+  uint64_t next_start = 0, now;
+
+  // Alternate the families, keeping the resolver's order within each.
+  for (ai = res; ai && ns + no < MAX_ADDRS; ai = ai->ai_next) {
+    if (ai->ai_family == res->ai_family)
+      same[ns++] = ai;
+    else
+      other[no++] = ai;
+  }
+  for (int i = 0; i < ns || i < no; i++) {
+    if (i < ns)
+      order[n++] = same[i];
+    if (i < no)
+      order[n++] = other[i];
+  }
+
+  while (winner < 0) {
+    int timeout;
+
+    now = now_ns();
+    if (now >= deadline) {
+      err = ETIMEDOUT;
+      break;
+    }
+    if (next < n && (live == 0 || now >= next_start)) {
+      ai = order[next++];
+      pfd[live].fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      pfd[live].events = POLLOUT;
+      if (pfd[live].fd < 0) {
+        err = errno;
+        continue;
+      }
+      tune_socket(pfd[live].fd, opts.profile);
+      if (connect(pfd[live].fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        pending[live] = ai;
+        winner = live++;
+        break;
+      }
+      if (errno != EINPROGRESS) {
+        err = errno;
+        close(pfd[live].fd);
+        continue;
+      }
+      pending[live++] = ai;
+      next_start = now + CONNECT_DELAY_MS * 1000000ULL;
+    }
+    if (live == 0) {
+      if (next < n)
+        continue;
+      break;
+    }
+
+    timeout = (int)((deadline - now + 999999) / 1000000);
+    if (next < n && next_start > now && (next_start - now + 999999) / 1000000 < (uint64_t)timeout)
+      timeout = (int)((next_start - now + 999999) / 1000000);
+    if (poll(pfd, live, timeout) < 0 && errno != EINTR) {
+      err = errno;
+      break;
+    }
+    for (int i = 0; i < live && winner < 0; i++) {
+      int soerr = 0;
+      socklen_t len = sizeof(soerr);
+
+      if (!pfd[i].revents)
+        continue;
+      getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+      if (soerr == 0) {
+        winner = i;
+        break;
+      }
+      err = soerr;
+      close(pfd[i].fd);
+      pfd[i] = pfd[--live];
+      pending[i] = pending[live];
+      i--;
+      next_start = 0;
+    }
+  }
+
+  for (int i = 0; i < live; i++)
+    if (i != winner)
+      close(pfd[i].fd);
+  if (winner < 0) {
+    errno = err;
+    return -1;
+  }
+  memcpy(&opts.addr, pending[winner]->ai_addr, pending[winner]->ai_addrlen);
+  opts.addrlen = pending[winner]->ai_addrlen;
+  fcntl(pfd[winner].fd, F_SETFL, fcntl(pfd[winner].fd, F_GETFL, 0) & ~O_NONBLOCK);
+  return pfd[winner].fd;
+}
+
+// Open one connection to the server over TCP or its UNIX socket.
+static int connect_server(void)
+{
+  int fd;
+
+  if (opts.transport == TRANSPORT_UNIX)
+    return local_connect(opts.local_path);
+  if ((fd = socket(opts.addr.ss_family, SOCK_STREAM, 0)) < 0)
+    return -1;
+  tune_socket(fd, opts.profile);
+  if (connect(fd, (struct sockaddr *)&opts.addr, opts.addrlen) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static void *load_loop(void *arg)
+{
+  struct load_thread *t = arg;
+  struct epoll_event ev, events[LOAD_EVENTS];
+  uint64_t interval = 0, next, now;
+  int epfd, rr = 0;
+
+  if ((epfd = epoll_create1(0)) < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (int i = 0; i < t->count; i++) {
+    struct load_conn *c = &t->conns[i];
+    if ((c->fd = connect_server()) < 0) {
+      perror("connect");
+      exit(1);
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    if (opts.zerocopy)
+      outq_zerocopy(&c->tx, c->fd, opts.zerocopy);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = i;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+  }
+  t->live = t->count;
+  t->sending = 1;
+
+  pthread_barrier_wait(&load_start);
+  next = now_ns();
+  // This thread's share of the open-loop rate, sent round-robin.
+  if (opts.rate > 0 && t->count > 0)
+    interval = (uint64_t)(1e9 * opts.conns / (opts.rate * t->count));
+  else
+    for (int i = 0; i < t->count; i++)
+      for (int w = 0; w < opts.window; w++)
+        if (load_send(t, &t->conns[i], next) < 0) {
+          t->errors++;
+          load_close(t, &t->conns[i]);
+          break;
+        }
+
+  while (t->live > 0) {
+    int timeout = 100, n;
+
+    outq_linger_reap();
+    now = now_ns();
+    if (t->sending && now >= load_end)
+      t->sending = 0;
+    if (!t->sending && (t->sent == t->received || now >= load_end + DRAIN_NS))
+      break;
+
+    if (t->sending && interval) {
+      while (next <= now) {
+        struct load_conn *c = &t->conns[rr++ % t->count];
+        if (c->fd >= 0 && load_send(t, c, next) < 0) {
+          t->errors++;
+          load_close(t, c);
+        }
+        next += interval;
+      }
+      timeout = (int)((next - now) / 1000000);
+    }
+
+    n = epoll_wait(epfd, events, LOAD_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      struct load_conn *c = &t->conns[events[i].data.u32];
+      uint32_t e = events[i].events;
+
+      if (c->fd < 0)
+        continue;
+      // Zero-copy completions also raise EPOLLERR.
+      if ((e & EPOLLERR) && opts.zerocopy && outq_reap(&c->tx, c->fd) == 0)
+        e &= ~EPOLLERR;
+      if ((e & EPOLLOUT) && outq_flush(&c->tx, c->fd, &load_limits) < 0)
+        e |= EPOLLERR;
+      if ((e & (EPOLLERR | EPOLLHUP)) || ((e & EPOLLIN) && load_read(t, c) < 0)
+          || (e & EPOLLRDHUP)) {
+        t->errors++;
+        load_close(t, c);
+      }
+    }
+  }
+
+  for (int i = 0; i < t->count; i++)
+    load_close(t, &t->conns[i]);
+  close(epfd);
+  return NULL;
+}
+
+// Load mode over shared memory. A ring has no descriptor for epoll, so
+// each thread drives exactly one connection and sleeps in shm_read().
+static void *shm_load_loop(void *arg)
+{
+  struct load_thread *t = arg;
+  struct load_conn *c = &t->conns[0];
+  struct echo_ctx ctx = { t, c };
+  char *buf = malloc(RECV_BUF);
+  uint64_t interval = 0, next, now;
+
+  if (!buf || !(c->shm = malloc(sizeof(*c->shm)))) {
+    perror("malloc");
+    exit(1);
+  }
+  if (shm_connect(c->shm, opts.local_path) < 0) {
+    perror("shm connect");
+    exit(1);
+  }
+  c->fd = c->shm->sock;
+  t->live = 1;
+  t->sending = 1;
+
+  pthread_barrier_wait(&load_start);
+  next = now_ns();
+  if (opts.rate > 0)
+    interval = (uint64_t)(1e9 * opts.conns / opts.rate);
+  else
+    for (int w = 0; w < opts.window; w++)
+      if (load_send(t, c, next) < 0) {
+        t->errors++;
+        load_close(t, c);
+        break;
+      }
+
+  while (t->live > 0) {
+    int timeout = 100;
+    ssize_t n;
+
+    now = now_ns();
+    if (t->sending && now >= load_end)
+      t->sending = 0;
+    if (!t->sending && (t->sent == t->received || now >= load_end + DRAIN_NS))
+      break;
+
+    if (t->sending && interval) {
+      while (next <= now && c->fd >= 0) {
+        if (load_send(t, c, next) < 0) {
+          t->errors++;
+          load_close(t, c);
+        }
+        next += interval;
+      }
+      timeout = (int)((next - now) / 1000000);
+    }
+    if (c->fd < 0)
+      break;
+
+    n = shm_read(c->shm, buf, RECV_BUF, timeout);
+    if (n < 0 && errno == ETIMEDOUT)
+      continue;
+    if (n <= 0 || frame_feed(&c->rx, buf, n, on_echo, &ctx) != 0) {
+      t->errors++;
+      load_close(t, c);
+    }
+  }
+
+  load_close(t, c);
+  free(buf);
+  return NULL;
+}
+
+// Run the load once, filling lat. Returns the number of connection errors.
+static unsigned long load_run(struct hist *lat, unsigned long *sent, unsigned long *received)
+{
+  struct load_thread *threads = calloc(opts.threads, sizeof(*threads));
+  struct load_conn *conns = calloc(opts.conns, sizeof(*conns));
+  unsigned long errors = 0;
+  int first = 0;
+
+  if (!threads || !conns) {
+    perror("malloc");
+    exit(1);
+  }
+  pthread_barrier_init(&load_start, NULL, opts.threads + 1);
+
+  for (int i = 0; i < opts.threads; i++) {
+    struct load_thread *t = &threads[i];
+    t->count = opts.conns / opts.threads + (i < opts.conns % opts.threads);
+    t->conns = conns + first;
+    first += t->count;
+    if (!(t->payload = malloc(opts.size))) {
+      perror("malloc");
+      exit(1);
+    }
+    memset(t->payload, 'x', opts.size);
+    if (pthread_create(&t->tid, NULL, opts.transport == TRANSPORT_SHM ? shm_load_loop : load_loop,
+                       t) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  // Every connection is open once the barrier trips; start the clock.
+  load_end = now_ns() + (uint64_t)opts.secs * 1000000000ULL;
+  pthread_barrier_wait(&load_start);
+
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_join(threads[i].tid, NULL);
+    hist_merge(lat, &threads[i].lat);
+    *sent += threads[i].sent;
+    *received += threads[i].received;
+    errors += threads[i].errors;
+    free(threads[i].payload);
+  }
+
+  pthread_barrier_destroy(&load_start);
+  free(conns);
+  free(threads);
+  return errors;
+}
+
+static int run_load(void)
+{
+  struct hist *lat = malloc(sizeof(*lat));
+  unsigned long sent = 0, received = 0, errors;
+
+  if (!lat) {
+    perror("malloc");
+    exit(1);
+  }
+  hist_reset(lat);
+  errors = load_run(lat, &sent, &received);
+
+  printf("%d connections, %d threads, %d-byte messages, %s for %ds over %s\n",
+         opts.conns, opts.threads, opts.size,
+         opts.rate > 0 ? "open loop" : "closed loop", opts.secs,
+         transport_names[opts.transport]);
+  if (opts.rate > 0)
+    printf("target rate: %.0f msgs/sec\n", opts.rate);
+  printf("sent %lu, received %lu, connection errors %lu\n", sent, received, errors);
+  printf("throughput: %.0f msgs/sec\n", (double)received / opts.secs);
+  printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+         hist_percentile(lat, 50) / 1e3, hist_percentile(lat, 99) / 1e3,
+         hist_percentile(lat, 99.9) / 1e3, lat->max / 1e3);
+
+  free(lat);
+  return errors ? 1 : 0;
+}
+
+// -R: repeat the same load under every socket profile and compare
+// round-trip times. By default that is one connection ping-ponging
+// 64-byte messages, where Nagle and delayed ACKs show up most clearly.
+static int run_rtt(void)
+{
+  struct hist *lat = malloc(sizeof(*lat));
+  unsigned long errors = 0;
+  uint64_t base = 0;
+
+  if (!lat) {
+    perror("malloc");
+    exit(1);
+  }
+  printf("%d connections, %d threads, %d-byte messages, window %d, %ds per profile over %s\n",
+         opts.conns, opts.threads, opts.size, opts.window, opts.secs,
+         transport_names[opts.transport]);
+  printf("%-10s %10s %9s %9s %9s %14s\n",
+         "profile", "msgs/sec", "p50_us", "p99_us", "p999_us", "p50 vs default");
+  for (int p = 0; p < TUNE_PROFILES; p++) {
+    unsigned long sent = 0, received = 0;
+    uint64_t p50;
+
+    opts.profile = p;
+    hist_reset(lat);
+    errors += load_run(lat, &sent, &received);
+    p50 = hist_percentile(lat, 50);
+    if (p == TUNE_DEFAULT)
+      base = p50;
+    printf("%-10s %10.0f %9.1f %9.1f %9.1f %+13.1f%%\n", tune_name(p),
+           (double)received / opts.secs, p50 / 1e3, hist_percentile(lat, 99) / 1e3,
+           hist_percentile(lat, 99.9) / 1e3, base ? 100.0 * ((double)p50 - base) / base : 0);
+  }
+  if (errors)
+    printf("connection errors %lu\n", errors);
+
+  free(lat);
+  return errors ? 1 : 0;
+}
+
+// Storm mode (-S): every connection is opened at once, the way clients
+// pile back in after a server restart, and counts as re-established once
+// its first frame has been echoed (run the server with -e). The result is
+// how long the last one took, with the distribution of connect and echo
+// times, all measured from the start of the storm.
+struct storm_thread {
+  pthread_t tid;
+  struct load_conn *conns;
+  int count, first;         // first: index of conns[0] over all threads
+  struct hist connected, echoed;
+  unsigned long done;
+  uint64_t last;            // when this thread's last client was back
+};
+
+static uint64_t storm_begin;
+
+static int storm_echo(void *arg, const char *msg, size_t len)
+{
+  (void)msg;
+  if (len > 0)              // not a keepalive ping
+    *(int *)arg = 1;
+  return 0;
+}
+
+static int storm_read(struct load_conn *c, int *echoed)
+{
+  char buf[RECV_BUF];
+
+  while (1) {
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      if (frame_feed(&c->rx, buf, n, storm_echo, echoed) != 0)
+        return -1;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+}
+
+// Start a non-blocking connect. A loopback server is reached from
+// STORM_SOURCES source addresses, since one address has only ~28k
+// ephemeral ports to connect from.
+static int storm_connect(struct load_conn *c, int index)
+{
+  int one = 1;
+
+  if ((c->fd = socket(opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    return -1;
+  tune_socket(c->fd, opts.profile);
+  if (opts.addr.ss_family == AF_INET && is_loopback((struct sockaddr *)&opts.addr)) {
+    struct sockaddr_in src = { 0 };
+
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index % STORM_SOURCES);
+    // Leave the port to connect(), which only needs the 4-tuple unique.
+    setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    if (bind(c->fd, (struct sockaddr *)&src, sizeof(src)) < 0)
+      return -1;
+  }
+  // With a cookie from an earlier connection the first frame rides in
+  // the SYN and connect() returns at once.
+  if (opts.fastopen)
+    setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+  if (connect(c->fd, (struct sockaddr *)&opts.addr, opts.addrlen) < 0 &&
+      errno != EINPROGRESS)
+    return -1;
+  return 0;
+}
+
+static void *storm_loop(void *arg)
+{
+  struct storm_thread *t = arg;
+  struct epoll_event ev, events[LOAD_EVENTS];
+  char *payload = calloc(1, opts.size);
+  int epfd, pending = t->count;
+
+  if (!payload || (epfd = epoll_create1(0)) < 0) {
+    perror("storm setup");
+    exit(1);
+  }
+  pthread_barrier_wait(&load_start);
+
+  for (int i = 0; i < t->count; i++) {
+    struct load_conn *c = &t->conns[i];
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = i;
+    if (storm_connect(c, t->first + i) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+      if (c->fd >= 0)
+        close(c->fd);
+      c->fd = -1;
+      pending--;
+    }
+  }
+
+  while (pending > 0) {
+    uint64_t now = now_ns();
+    int n;
+
+    if (now >= load_end)
+      break;
+    n = epoll_wait(epfd, events, LOAD_EVENTS, 100);
+    now = now_ns();
+    for (int i = 0; i < n; i++) {
+      struct load_conn *c = &t->conns[events[i].data.u32];
+      uint32_t e = events[i].events;
+      int echoed = 0, bad = 0;
+
+      if (c->fd < 0 || c->state == 2)
+        continue;
+      if (c->state == 0 && (e & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        struct msgbuf *b;
+
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || !(b = msgbuf_frame(payload, opts.size))) {
+          bad = 1;
+        } else {
+          c->state = 1;
+          hist_record(&t->connected, now - storm_begin);
+          bad = outq_send(&c->tx, c->fd, b, &load_limits) < 0;
+          msgbuf_unref(b);
+        }
+      } else if ((e & EPOLLOUT) && !outq_empty(&c->tx)) {
+        bad = outq_flush(&c->tx, c->fd, &load_limits) < 0;
+      }
+      if (!bad && c->state == 1 && (e & EPOLLIN))
+        bad = storm_read(c, &echoed) < 0;
+      if (echoed) {
+        // Back; hold the connection open until the storm is over.
+        c->state = 2;
+        hist_record(&t->echoed, now - storm_begin);
+        t->done++;
+        t->last = now;
+        pending--;
+      } else if (bad || (e & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+        close(c->fd);
+        c->fd = -1;
+        pending--;
+      }
+    }
+  }
+
+  for (int i = 0; i < t->count; i++) {
+    struct load_conn *c = &t->conns[i];
+    frame_parser_reset(&c->rx);
+    outq_clear(&c->tx, c->fd);
+    if (c->fd >= 0)
+      close(c->fd);
+  }
+  close(epfd);
+  free(payload);
+  return NULL;
+}
+
+static int run_storm(void)
+{
+  struct storm_thread *threads = calloc(opts.threads, sizeof(*threads));
+  struct load_conn *conns = calloc(opts.conns, sizeof(*conns));
+  struct hist *connected = malloc(sizeof(*connected));
+  struct hist *echoed = malloc(sizeof(*echoed));
+  unsigned long done = 0;
+  uint64_t last = 0;
+  int first = 0;
+
+  if (!threads || !conns || !connected || !echoed) {
+    perror("malloc");
+    exit(1);
+  }
+  hist_reset(connected);
+  hist_reset(echoed);
+  pthread_barrier_init(&load_start, NULL, opts.threads + 1);
+
+  for (int i = 0; i < opts.threads; i++) {
+    struct storm_thread *t = &threads[i];
+    t->count = opts.conns / opts.threads + (i < opts.conns % opts.threads);
+    t->conns = conns + first;
+    t->first = first;
+    first += t->count;
+    if (pthread_create(&t->tid, NULL, storm_loop, t) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  // -d bounds the whole storm; stragglers after that count as failed.
+  storm_begin = now_ns();
+  load_end = storm_begin + (uint64_t)opts.secs * 1000000000ULL;
+  pthread_barrier_wait(&load_start);
+
+  for (int i = 0; i < opts.threads; i++) {
+    pthread_join(threads[i].tid, NULL);
+    hist_merge(connected, &threads[i].connected);
+    hist_merge(echoed, &threads[i].echoed);
+    done += threads[i].done;
+    if (threads[i].last > last)
+      last = threads[i].last;
+  }
+
+  printf("%d connections, %d threads, %d-byte first frame%s\n", opts.conns, opts.threads,
+         opts.size, opts.fastopen ? ", TCP Fast Open" : "");
+  printf("re-established %lu, failed %lu\n", done, opts.conns - done);
+  printf("connect (ms): p50 %.1f  p99 %.1f  max %.1f\n",
+         hist_percentile(connected, 50) / 1e6, hist_percentile(connected, 99) / 1e6,
+         connected->max / 1e6);
+  printf("echo (ms): p50 %.1f  p99 %.1f  max %.1f\n",
+         hist_percentile(echoed, 50) / 1e6, hist_percentile(echoed, 99) / 1e6,
+         echoed->max / 1e6);
+  if (done)
+    printf("all back in: %.1f ms\n", (last - storm_begin) / 1e6);
+
+  pthread_barrier_destroy(&load_start);
+  free(echoed);
+  free(connected);
+  free(conns);
+  free(threads);
+  return done == (unsigned long)opts.conns ? 0 : 1;
+}
+
+// Bulk mode (-B): stream a file, or stdin for "-", to the server as fast
+// as it will take it. Every non-empty line is one message; a line longer
+// than BULK_CHUNK goes out as several. Input is read a chunk at a time
+// and its lines are framed in place, header and payload as separate
+// iovecs, so each writev carries hundreds of messages without copying
+// them and nothing waits for a reply. Echoes (server run with -e) are
+// counted as they come back.
+struct bulk {
+  int fd;
+  struct frame_parser rx;
+  struct iovec iov[BULK_IOV];
+  char hdr[BULK_IOV / 2][FRAME_HDR];
+  int iovcnt;
+  unsigned long sent, received, writes;
+  uint64_t bytes;
+};
+
+static int bulk_echo(void *arg, const char *msg, size_t len)
+{
+  struct bulk *b = arg;
+
+  if (len > 0)
+    b->received++;
+  return 0;
+}
+
+// Take whatever the server has sent back. Returns -1 once it has gone.
+static int bulk_read(struct bulk *b)
+{
+  char buf[RECV_BUF];
+
+  while (1) {
+    ssize_t n = recv(b->fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      if (frame_feed(&b->rx, buf, n, bulk_echo, b) != 0)
+        return -1;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+}
+
+// Send every queued message. While the socket is full, keep reading
+// echoes: an echoing server that cannot write to us stops reading too.
+static int bulk_flush(struct bulk *b)
+{
+  struct iovec *iov = b->iov;
+  int cnt = b->iovcnt;
+
+  b->iovcnt = 0;
+  while (cnt > 0) {
+    ssize_t n = writev(b->fd, iov, cnt);
+    if (n < 0) {
+      struct pollfd pfd = { b->fd, POLLIN | POLLOUT, 0 };
+
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      if (errno != EINTR && poll(&pfd, 1, -1) > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) &&
+          bulk_read(b) < 0)
+        return -1;
+      continue;
+    }
+    b->writes++;
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return bulk_read(b);
+}
+
+// Queue one message; msg must stay put until the next flush.
+static int bulk_queue(struct bulk *b, const char *msg, size_t len)
+{
+  char *hdr;
+
+  // An empty frame is a keepalive ping, not a message.
+  if (len == 0)
+    return 0;
+  if (b->iovcnt == BULK_IOV && bulk_flush(b) < 0)
+    return -1;
+  hdr = b->hdr[b->iovcnt / 2];
+  frame_put_header(hdr, (uint32_t)len);
+  b->iov[b->iovcnt].iov_base = hdr;
+  b->iov[b->iovcnt++].iov_len = FRAME_HDR;
+  b->iov[b->iovcnt].iov_base = (char *)msg;
+  b->iov[b->iovcnt++].iov_len = len;
+  b->sent++;
+  b->bytes += len;
+  return 0;
+}
+
+static int run_bulk(const char *path, int fd)
+{
+  struct bulk *b = calloc(1, sizeof(*b));
+  char *buf = malloc(BULK_CHUNK);
+  size_t carry = 0;
+  uint64_t start, elapsed, quiet;
+  int in, failed = 0;
+
+  if (!b || !buf) {
+    perror("malloc");
+    exit(1);
+  }
+  if (strcmp(path, "-") == 0) {
+    in = STDIN_FILENO;
+  } else if ((in = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    exit(1);
+  } else {
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  b->fd = fd;
+  fcntl(b->fd, F_SETFL, fcntl(b->fd, F_GETFL) | O_NONBLOCK);
+
+  start = now_ns();
+  while (!failed) {
+    ssize_t n = read(in, buf + carry, BULK_CHUNK - carry);
+    char *p = buf, *end, *nl;
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("read");
+      failed = 1;
+      break;
+    }
+    end = buf + carry + n;
+    while (!failed && (nl = memchr(p, '\n', end - p)) != NULL) {
+      failed = bulk_queue(b, p, nl - p) < 0;
+      p = nl + 1;
+    }
+    // At end of input the last line needs no newline; a line that fills
+    // the whole buffer is sent in pieces.
+    if (!failed && p < end && (n == 0 || (p == buf && end - buf == BULK_CHUNK))) {
+      failed = bulk_queue(b, p, end - p) < 0;
+      p = end;
+    }
+    // The queued messages point into buf, so they leave before the
+    // unfinished line moves down and the next chunk is read after it.
+    if (failed || bulk_flush(b) < 0) {
+      perror("server unavailable");
+      failed = 1;
+      break;
+    }
+    carry = end - p;
+    memmove(buf, p, carry);
+    if (n == 0)
+      break;
+  }
+  elapsed = now_ns() - start;
+  if (in != STDIN_FILENO)
+    close(in);
+
+  // Wait for echoes still on their way, until they stop coming.
+  quiet = now_ns();
+  while (!failed && b->received > 0 && b->received < b->sent &&
+         now_ns() - quiet < DRAIN_NS) {
+    struct pollfd pfd = { b->fd, POLLIN, 0 };
+    unsigned long before = b->received;
+
+    if (poll(&pfd, 1, 100) > 0 && bulk_read(b) < 0)
+      break;
+    if (b->received != before)
+      quiet = now_ns();
+  }
+
+  if (elapsed == 0)
+    elapsed = 1;
+  printf("bulk load of %s: %lu messages, %.1f MB in %.2fs over %s\n",
+         in == STDIN_FILENO ? "stdin" : path, b->sent, b->bytes / 1e6, elapsed / 1e9,
+         transport_names[opts.transport]);
+  printf("throughput: %.1f MB/sec, %.0f msgs/sec\n",
+         b->bytes / 1e6 / (elapsed / 1e9), b->sent / (elapsed / 1e9));
+  printf("%lu writes, %.1f messages per write\n", b->writes,
+         b->writes ? (double)b->sent / b->writes : 0);
+  if (b->received)
+    printf("echoed %lu of %lu\n", b->received, b->sent);
+
+  close(b->fd);
+  frame_parser_reset(&b->rx);
+  free(buf);
+  free(b);
+  return failed;
+}
+
+// Resolve -X auto once the server's addresses are known: local only if
+// all of them are loopback. A UNIX socket that accepts a connection means
+// the server really is on this host, rather than a stale socket file left
+// behind by one that has gone.
+static void pick_transport(int load, const struct addrinfo *res)
+{
+  int fd;
+
+  if (opts.transport != TRANSPORT_AUTO)
+    return;
+  opts.transport = TRANSPORT_TCP;
+  for (; res; res = res->ai_next)
+    if (!is_loopback(res->ai_addr))
+      return;
+  if ((fd = local_connect(opts.local_path)) < 0)
+    return;
+  close(fd);
+  opts.transport = load && opts.conns <= opts.threads ? TRANSPORT_SHM : TRANSPORT_UNIX;
+}
+
+// Interactive mode over shared memory: this thread prints what the server
+// sends while the main thread turns typed lines into frames.
+static void *shm_printer(void *arg)
+{
+  struct shm_chan *ch = arg;
+  struct frame_parser rx = { 0 };
+  char *buf = malloc(RECV_BUF);
+  ssize_t n;
+
+  while (buf && (n = shm_read(ch, buf, RECV_BUF, -1)) > 0) {
+    if (frame_feed(&rx, buf, n, print_message, NULL) < 0) {
+      perror("bad frame from server");
+      break;
+    }
+  }
+  printf("server disconnected.\n");
+  exit(0);
+}
+
+static int run_shm_chat(void)
+{
+  struct shm_chan ch;
+  pthread_t tid;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+
+  if (shm_connect(&ch, opts.local_path) < 0) {
+    perror("shm connect");
+    exit(1);
+  }
+  if (pthread_create(&tid, NULL, shm_printer, &ch) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+  while ((n = getline(&line, &cap, stdin)) > 0) {
+    if (line[n - 1] == '\n')
+      n--;
+    if (n > FRAME_MAX)
+      n = FRAME_MAX;
+    if (shm_send_frame(&ch, line, n) < 0) {
+      perror("server unavailable");
+      exit(1);
+    }
+  }
+  free(line);
+  // Like the socket client, keep printing after STDIN closes.
+  pthread_join(tid, NULL);
+  return 0;
+}
+
+// Load and storm modes can need far more descriptors than the soft limit.
+static void raise_fd_limit(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [host]\n"
+                  "       %s -n conns [-t threads] [-r msgs/sec] [-s bytes] [-d secs]"
+                  " [-w window]\n"
+                  "       %*s [-z zerocopy-min-bytes] [-p default|latency|throughput] [host]\n"
+                  "       %s -R [load options] [host]\n"
+                  "       %s -S -n conns [-t threads] [-s bytes] [-d timeout-secs] [-F] [host]\n"
+                  "       %s -B file|- [-p default|latency|throughput] [host]\n"
+                  "  interactive: [-I idle-secs] [-K keepalive-secs]\n"
+                  "  any mode but -S: [-X auto|tcp|unix|shm] [-U local-socket-path]"
+                  " (not shm with -B)\n"
+                  "  any mode: [-T connect-timeout-secs]\n",
+                  prog, prog, (int)strlen(prog), "", prog, prog, prog);
+  exit(1);
+}
 
 int main(int argc, char * argv[])
 {
-  struct hostent *hp;
-  struct sockaddr_in sin;
+  struct addrinfo *res;
   char *host;
-  char buf[MAX_LINE];
-  int s;
-  int len, max_fd = STDIN_FILENO;
+  char buf[RECV_BUF];
+  int s = -1, err;
+  uint64_t deadline;
+  int max_fd = STDIN_FILENO;
 	fd_set readfds;
 	struct timeval tv;
 	int activity;
+	// Interactive deadlines, as on the servers: close once the server has
+	// been silent for -I secs, ping it after -K secs without traffic.
+	struct timeouts timeouts = { 0 };
+	struct conn_timer clock = { 0 };
+	int stdin_open = 1;
+	struct buffer line = { 0 }, out = { 0 };
+	struct frame_parser rx = { 0 };
+	int opt, rtt = 0, storm = 0;
+	const char *bulk = NULL;
 
-  if (argc==2) {
-    host = argv[1];
+	while ((opt = getopt(argc, argv, "n:t:r:s:d:w:z:p:RSFX:U:B:T:I:K:")) != -1) {
+		switch (opt) {
+		case 'n': opts.conns = atoi(optarg); break;
+		case 't': opts.threads = atoi(optarg); break;
+		case 'r': opts.rate = atof(optarg); break;
+		case 's': opts.size = atoi(optarg); break;
+		case 'd': opts.secs = atoi(optarg); break;
+		case 'w': opts.window = atoi(optarg); break;
+		case 'z': opts.zerocopy = atoi(optarg); break;
+		case 'p':
+			if (tune_parse(optarg, &opts.profile) < 0)
+				usage(argv[0]);
+			break;
+		case 'R': rtt = 1; break;
+		case 'S': storm = 1; break;
+		case 'F': opts.fastopen = 1; break;
+		case 'X':
+			for (opts.transport = 0; opts.transport < TRANSPORTS; opts.transport++)
+				if (strcmp(optarg, transport_names[opts.transport]) == 0)
+					break;
+			if (opts.transport == TRANSPORTS)
+				usage(argv[0]);
+			break;
+		case 'U': opts.local_path = optarg; break;
+		case 'B': bulk = optarg; break;
+		case 'T': opts.connect_timeout = atof(optarg); break;
+		case 'I': timeouts.idle = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS; break;
+		case 'K': timeouts.keepalive = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (opts.conns < 0 || opts.threads < 1 || opts.threads > MAX_THREADS ||
+	    opts.size < (int)sizeof(uint64_t) || opts.size > FRAME_MAX ||
+	    opts.secs < 1 || opts.window < 1 || opts.rate < 0 || opts.zerocopy < 0 ||
+	    opts.connect_timeout <= 0 || optind < argc - 1)
+		usage(argv[0]);
+	if (storm && opts.conns == 0)
+		usage(argv[0]);
+	if (bulk && (opts.conns > 0 || rtt || storm || opts.transport == TRANSPORT_SHM))
+		usage(argv[0]);
+	if (!opts.local_path)
+		opts.local_path = local_default_path();
+	if (rtt && opts.conns == 0)
+		opts.conns = 1;
+	if (opts.threads > opts.conns && opts.conns > 0)
+		opts.threads = opts.conns;
+
+  if (optind < argc) {
+    host = argv[optind];
   }
   else {
 		// default localhost
 		host = "localhost";
   }
 
-  /* translate host name into peer's IP address */
-  hp = gethostbyname(host);
-  if (!hp) {
-    fprintf(stderr, "simplex-talk: unknown host: %s\n", host);
+  /* translate host name into peer's IPv4 and IPv6 addresses */
+  deadline = now_ns() + (uint64_t)(opts.connect_timeout * 1e9);
+  if ((err = resolve(host, deadline, &res)) != 0) {
+    fprintf(stderr, "simplex-talk: unknown host: %s (%s)\n", host,
+            err == EAI_SYSTEM ? strerror(errno) : gai_strerror(err));
     exit(1);
   }
 
-  /* build address data structure */
-  bzero((char *)&sin, sizeof(sin));
-  sin.sin_family = AF_INET;
-  bcopy(hp->h_addr, (char *)&sin.sin_addr, hp->h_length);
-  sin.sin_port = htons(SERVER_PORT);
+  // A reconnect storm is about the TCP accept path, so it never goes local.
+  if (storm)
+    opts.transport = TRANSPORT_TCP;
+  pick_transport(opts.conns > 0, res);
 
-  /* active open */
-  if ((s = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("socket");
+  // Over TCP, find the address that answers first. Load and storm modes
+  // then open all their connections to that one.
+  if (opts.transport == TRANSPORT_TCP && (s = race_connect(res, deadline)) < 0) {
+    fprintf(stderr, "simplex-talk: connect to %s: %s\n", host, strerror(errno));
     exit(1);
   }
-  if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
-  {
+  freeaddrinfo(res);
+  if (opts.transport == TRANSPORT_SHM && opts.conns > 0) {
+    // One thread per shared-memory connection.
+    if (opts.conns > MAX_THREADS)
+      usage(argv[0]);
+    opts.threads = opts.conns;
+  }
+
+  if (opts.conns > 0) {
+    if (s >= 0)
+      close(s);
+    raise_fd_limit();
+    if (storm)
+      return run_storm();
+    return rtt ? run_rtt() : run_load();
+  }
+  if (opts.transport == TRANSPORT_SHM)
+    return run_shm_chat();
+
+  /* active open */
+  if (s < 0 && (s = connect_server()) < 0) {
     perror("connect");
-    close(s);
     exit(1);
   }
+  if (bulk)
+    return run_bulk(bulk, s);
 	max_fd = (s > max_fd) ? s : max_fd;
+	clock.last_rx = clock.last_tx = timer_now();
 
 	while(1) {
+		uint64_t now = timer_now(), next;
+		enum timer_action action = conn_timer_check(&clock, &timeouts, now, &next);
+
+		if (action == TIMER_PING) {
+			char ping[FRAME_HDR];
+
+			frame_put_header(ping, 0);
+			if (send_all(s, ping, FRAME_HDR) < 0) {
+				perror("server unavailable");
+				break;
+			}
+			clock.last_tx = now;
+			action = conn_timer_check(&clock, &timeouts, now, &next);
+		}
+		if (action == TIMER_IDLE) {
+			printf("No activity from the server for %lu secs, closing.\n",
+			       (unsigned long)(timeouts.idle * TIMER_TICK_MS / 1000));
+			break;
+		}
+
 		FD_ZERO(&readfds);
 		FD_SET(s, &readfds);
-		FD_SET(STDIN_FILENO, &readfds);
+		if (stdin_open)
+			FD_SET(STDIN_FILENO, &readfds);
 
-		tv.tv_sec = 30;
-		tv.tv_usec = 0;
+		// Sleep until the next deadline, or for good if none is set.
+		tv.tv_sec = (next - now) * TIMER_TICK_MS / 1000;
+		tv.tv_usec = (next - now) * TIMER_TICK_MS % 1000 * 1000;
 
-		activity = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+		activity = select(max_fd + 1, &readfds, NULL, NULL, action == TIMER_NONE ? NULL : &tv);
 
 		if (activity < 0) {
 			perror("select");
 			break;
 		} else if (activity == 0) {
-			printf("No activity for 30 secs.\n");
 			continue;
 		}
 
-		if (FD_ISSET(STDIN_FILENO, &readfds)) {
-			if (fgets(buf, sizeof(buf), stdin) != NULL) {
-    		buf[MAX_LINE-1] = '\0';
-    		len = strlen(buf) + 1;
-  			if (send(s, buf, len, 0) < 0) {
+		if (stdin_open && FD_ISSET(STDIN_FILENO, &readfds)) {
+			ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+			char *p = buf, *end = buf + (n > 0 ? n : 0), *nl;
+
+			// Split the chunk into lines; each complete line becomes a frame.
+			while (p < end) {
+				nl = memchr(p, '\n', end - p);
+				size_t seg = (nl ? nl : end) - p;
+				if (line.len + seg > FRAME_MAX)
+					seg = line.len < FRAME_MAX ? FRAME_MAX - line.len : 0;
+				buffer_append(&line, p, seg);
+				if (!nl)
+					break;
+				queue_frame(&out, line.data, line.len);
+				line.len = 0;
+				p = nl + 1;
+			}
+			if (n <= 0) {
+				if (line.len > 0)
+					queue_frame(&out, line.data, line.len);
+				line.len = 0;
+				stdin_open = 0;
+			}
+			if (out.len > 0) {
+				if (send_all(s, out.data, out.len) < 0) {
 					perror("server unavailable");
-					close(s);
 					break;
 				}
+				out.len = 0;
+				clock.last_tx = timer_now();
 			}
 		}
 
@@ -94,8 +1463,12 @@ int main(int argc, char * argv[])
 				printf("server disconnected.\n");
 				break;
 			}
-    	buf[MAX_LINE-1] = '\0';
-			printf("%s\n", buf);
+			clock.last_rx = timer_now();
+			if (frame_feed(&rx, buf, bytes, print_message, &s) < 0) {
+				perror("bad frame from server");
+				break;
+			}
+			tune_after_read(s, opts.profile);
 		}
 	}
 	close(s);
@@ -0,0 +1,169 @@
+// framing.c
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include "framing.h"
+#include "pool.h"
+
+// Larger frames start out in a pooled buffer and move to the heap once
+// they outgrow it, so with a pool set cap == pool->size means pooled.
+static int frame_pooled(const struct frame_parser *p) {
+    return p->pool && p->buf && p->cap == p->pool->size;
+}
+
+static int frame_reserve(struct frame_parser *p, size_t need) {
+    char *nbuf;
+    size_t ncap = p->cap ? p->cap : 256;
+
+    if (need <= p->cap)
+        return 0;
+    if (!p->buf && p->pool && need <= p->pool->size) {
+        if (!(p->buf = pool_get(p->pool)))
+            return -1;
+        p->cap = p->pool->size;
+        return 0;
+    }
+    while (ncap < need)
+        ncap *= 2;
+    if (frame_pooled(p)) {
+        if (!(nbuf = malloc(ncap)))
+            return -1;
+        memcpy(nbuf, p->buf, p->len);
+        pool_put(p->pool, p->buf);
+    } else if (!(nbuf = realloc(p->buf, ncap))) {
+        return -1;
+    }
+    p->buf = nbuf;
+    p->cap = ncap;
+    return 0;
+}
+
+void frame_parser_reset(struct frame_parser *p) {
+    if (frame_pooled(p))
+        pool_put(p->pool, p->buf);
+    else
+        free(p->buf);
+    p->buf = NULL;
+    p->len = 0;
+    p->cap = 0;
+}
+
+// Top up the buffered partial frame from data. Returns the bytes consumed;
+// *done is set once the buffer holds a whole frame.
+static size_t frame_fill(struct frame_parser *p, const char *data, size_t n, int *done) {
+    size_t want, take;
+
+    *done = 0;
+    if (p->len < FRAME_HDR) {
+        take = FRAME_HDR - p->len < n ? FRAME_HDR - p->len : n;
+        memcpy(p->buf + p->len, data, take);
+        p->len += take;
+        if (p->len < FRAME_HDR)
+            return take;
+        data += take;
+        n -= take;
+    } else {
+        take = 0;
+    }
+
+    want = FRAME_HDR + frame_get_header(p->buf);
+    if (want - FRAME_HDR > FRAME_MAX) {
+        errno = EMSGSIZE;
+        return (size_t)-1;
+    }
+    if (frame_reserve(p, want) < 0)
+        return (size_t)-1;
+
+    n = want - p->len < n ? want - p->len : n;
+    memcpy(p->buf + p->len, data, n);
+    p->len += n;
+    *done = (p->len == want);
+    return take + n;
+}
+
+int frame_feed(struct frame_parser *p, const char *data, size_t n, frame_cb cb, void *ctx) {
+    int done, ret;
+
+    // Finish a frame left over from an earlier read first.
+    if (p->len > 0) {
+        size_t used = frame_fill(p, data, n, &done);
+        if (used == (size_t)-1)
+            return -1;
+        data += used;
+        n -= used;
+        if (!done)
+            return 0;
+        ret = cb(ctx, p->buf + FRAME_HDR, p->len - FRAME_HDR);
+        frame_parser_reset(p);
+        if (ret)
+            return ret;
+    }
+
+    // Every complete frame in the read is delivered in place.
+    while (n >= FRAME_HDR) {
+        uint32_t len = frame_get_header(data);
+        if (len > FRAME_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (n - FRAME_HDR < len)
+            break;
+        ret = cb(ctx, data + FRAME_HDR, len);
+        if (ret)
+            return ret;
+        data += FRAME_HDR + len;
+        n -= FRAME_HDR + len;
+    }
+
+    // Keep the tail for the next read.
+    if (n > 0) {
+        if (frame_reserve(p, FRAME_HDR) < 0)
+            return -1;
+        if (frame_fill(p, data, n, &done) == (size_t)-1)
+            return -1;
+    }
+    return 0;
+}
+
+int frame_send(int fd, const void *payload, size_t len) {
+    char hdr[FRAME_HDR];
+    struct iovec iov[2];
+    int iovcnt = 2;
+    struct iovec *v = iov;
+
+    if (len > FRAME_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    frame_put_header(hdr, (uint32_t)len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = FRAME_HDR;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, v, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+// framing.h
+// Length-prefixed message framing shared by the client and both servers.
+//
+// Every message on the wire is a 4-byte big-endian payload length followed
+// by the payload itself. Payloads are not NUL-terminated and may hold any
+// bytes, up to FRAME_MAX.
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool;
+
+#define FRAME_HDR  4
+#define FRAME_MAX  (16u * 1024 * 1024)
+
+// Incremental parser state for one byte stream. Complete frames are
+// handed out straight from the caller's buffer; only a frame that spans
+// reads is copied into buf, which grows to fit it and is then released.
+// If pool is set, frames that fit in one of its objects are assembled
+// there instead of in malloc'd memory.
+struct frame_parser {
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct pool *pool;
+};
+
+// Called once per complete frame. A non-zero return stops parsing and is
+// passed back to the caller of frame_feed().
+typedef int (*frame_cb)(void *ctx, const char *payload, size_t len);
+
+// Feed n bytes of stream data. Returns 0, the first non-zero callback
+// result, or -1 (errno EMSGSIZE) if a frame header exceeds FRAME_MAX.
+int frame_feed(struct frame_parser *p, const char *data, size_t n, frame_cb cb, void *ctx);
+
+// True while a partial frame is buffered.
+static inline int frame_pending(const struct frame_parser *p) {
+    return p->len > 0;
+}
+
+void frame_parser_reset(struct frame_parser *p);
+
+static inline void frame_put_header(char *hdr, uint32_t len) {
+    hdr[0] = (char)(len >> 24);
+    hdr[1] = (char)(len >> 16);
+    hdr[2] = (char)(len >> 8);
+    hdr[3] = (char)len;
+}
+
+static inline uint32_t frame_get_header(const char *hdr) {
+    const unsigned char *h = (const unsigned char *)hdr;
+    return ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) | ((uint32_t)h[2] << 8) | h[3];
+}
+
+// Send one frame with a single writev, finishing partial writes. On a
+// non-blocking socket this waits for POLLOUT rather than failing.
+int frame_send(int fd, const void *payload, size_t len);
+
+#endif
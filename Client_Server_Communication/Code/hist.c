@@ -0,0 +1,43 @@
+// hist.c
+#include <string.h>
+#include "hist.h"
+
+void hist_reset(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_merge(struct hist *dst, const struct hist *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_bucket_value(unsigned i) {
+    unsigned shift;
+
+    if (i < 2 * HIST_SUB_BUCKETS)
+        return i;
+    shift = i / HIST_SUB_BUCKETS - 1;
+    return (((uint64_t)(i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct hist *h, double pct) {
+    uint64_t want, seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    want = (uint64_t)(pct / 100.0 * h->total + 0.5);
+    if (want < 1)
+        want = 1;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t v = hist_bucket_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,50 @@
+// hist.h
+// Log-linear latency histogram in the style of HdrHistogram: values are
+// grouped by power of two, and each power of two is split into
+// HIST_SUB_BUCKETS linear sub-buckets, so every recorded value is kept to
+// within 1/HIST_SUB_BUCKETS (about 1.6%) of its true size with a fixed
+// amount of memory and no allocation on the record path.
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS     6
+#define HIST_SUB_BUCKETS  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS      ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    uint64_t sum;
+};
+
+static inline unsigned hist_index(uint64_t v) {
+    unsigned msb, shift;
+
+    if (v < 2 * HIST_SUB_BUCKETS)
+        return (unsigned)v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (unsigned)(v >> shift) - HIST_SUB_BUCKETS;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_reset(struct hist *h);
+void hist_merge(struct hist *dst, const struct hist *src);
+
+// Largest value of the sub-bucket at index i.
+uint64_t hist_bucket_value(unsigned i);
+
+// Value at or below which the given percentage (0-100) of samples fall.
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+#endif
@@ -0,0 +1,816 @@
+// server_coro.cc
+// Coroutine server: the protocol and operator commands of the thread and
+// event servers, with each connection run by a pair of C++20 coroutines.
+// The reader and writer are written as the blocking loops a thread would
+// run, but where a thread would block they suspend instead, and a
+// per-thread epoll scheduler resumes them when their socket is ready.
+// One scheduler thread multiplexes all of its connections like an event
+// reactor; with -w several schedulers split the port with SO_REUSEPORT.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include "affinity.h"
+#include "framing.h"
+#include "local.h"
+#include "metrics.h"
+#include "outq.h"
+#include "tune.h"
+}
+
+#define SERVER_PORT    5432
+#define MAX_PENDING    SOMAXCONN  // load tests open connections in bursts
+#define MAX_LINE       256  // operator lines typed on STDIN
+#define MAX_TARGETS    128  // sockets named in one @fd,fd,... command
+#define RECV_BUF       65536
+#define MAX_EVENTS     256  // events harvested per epoll_wait
+#define MAX_SCHEDULERS 256  // upper bound for -w
+
+// Output queue watermarks and slow-consumer policy (-H, -L, -P).
+static struct outq_limits limits = { 4 << 20, 1 << 20, OUTQ_DROP };
+
+// UNIX socket serving metrics scrapes (-M); NULL = not served, and
+// message handling is then not timed.
+static const char *metrics_path;
+
+// Socket tuning profile (-p), applied to the listener.
+static enum tune_profile profile;
+
+// Path of the UNIX-domain listener for local clients (-U); its
+// shared-memory handshake socket is next to it. NULL = the per-user
+// local_default_path(), empty = TCP only.
+static const char *local_path;
+
+// CPUs the schedulers are pinned to (-c), and the network device whose
+// interrupts and RPS are steered onto them (-n); NULL = leave it alone.
+static struct placement placement;
+static const char *steer_dev;
+
+// Accept queue depth and optional listener features (-b, -A, -F).
+static struct listen_opts listen_opts = { MAX_PENDING, 0, 0 };
+
+// Load-test switches: echo every frame back (-e), don't print it (-q).
+static int echo_mode;
+static int quiet;
+
+/*-------------------------------------------------
+ * Coroutine plumbing
+ *-------------------------------------------------*/
+
+// A coroutine that starts as soon as it is called and frees itself when
+// it returns. Nothing awaits it: it only ever waits on a descriptor.
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Suspend the calling coroutine, leaving its handle in slot for whoever
+// should resume it.
+struct park {
+    std::coroutine_handle<> *slot;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { *slot = h; }
+    void await_resume() const noexcept {}
+};
+
+// A descriptor registered with a scheduler's epoll set, and the
+// coroutines parked until it can be read or written.
+struct pollable {
+    int fd;
+    std::coroutine_handle<> in, out;
+};
+
+static park readable(pollable *p) { return park{ &p->in }; }
+static park writable(pollable *p) { return park{ &p->out }; }
+
+struct scheduler;
+
+struct conn : pollable {
+    struct scheduler *s;
+    struct frame_parser rx;
+    struct outq tx;
+    std::coroutine_handle<> idle;   // writer waiting for queued output
+    size_t slot;                    // index in the scheduler's conns
+    int refs;                       // reader and writer still running
+    bool closing;
+};
+
+// One per thread: an epoll set and the coroutines it drives.
+struct scheduler {
+    int id;
+    int epfd;
+    pollable listener;
+    pollable local;                 // UNIX-domain listener, scheduler 0 only
+    pollable mbox;                  // eventfd: work posted by other threads
+    pollable input;                 // STDIN, scheduler 0 only
+    std::mutex mbox_lock;
+    std::vector<std::function<void()>> posted;
+    std::vector<std::coroutine_handle<>> ready; // woken by another coroutine
+    std::vector<conn *> conns;
+    int count;                      // conns.size(), readable by other threads
+    struct metrics metrics;
+    pthread_t tid;
+};
+
+static struct scheduler schedulers[MAX_SCHEDULERS];
+static int num_schedulers = 1;
+static int max_fds;
+
+// Which scheduler owns each connected descriptor, as id + 1 (0 = none),
+// so the operator can address clients by fd; the owner's conns are in
+// conn_at. Both start zeroed, so their pages are only touched once their
+// descriptors are used.
+static int *owner_of;
+static conn **conn_at;
+
+// The scheduler that owns fd, or -1.
+static int fd_owner(int fd) {
+    return fd < max_fds ? __atomic_load_n(&owner_of[fd], __ATOMIC_RELAXED) - 1 : -1;
+}
+
+// Let a coroutine parked in slot run once the current batch of events
+// is handled. Deferring it means a writer woken by many replies in one
+// read sends them all with a single sendmsg.
+static void wake(struct scheduler *s, std::coroutine_handle<> &slot) {
+    if (slot) {
+        s->ready.push_back(slot);
+        slot = nullptr;
+    }
+}
+
+// Run fn on scheduler s, from any thread.
+static void post(struct scheduler *s, std::function<void()> fn) {
+    uint64_t one = 1;
+
+    {
+        std::lock_guard<std::mutex> hold(s->mbox_lock);
+        s->posted.push_back(std::move(fn));
+    }
+    if (write(s->mbox.fd, &one, sizeof(one)) < 0)
+        perror("mailbox write failed");
+}
+
+static void watch(struct scheduler *s, pollable *p, uint32_t events) {
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = p;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Raise the open file limit to the hard maximum so the server is bounded
+// by the kernel rather than the default of 1024 descriptors.
+static int raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("getrlimit failed");
+        exit(1);
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit failed");
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return (int)rl.rlim_cur;
+}
+
+// With reuseport set, every scheduler binds its own listener to the port
+// and the kernel load-balances incoming connections between them.
+static int make_listener(int reuseport) {
+    struct sockaddr_in sin;
+    int listen_sock, on = 1;
+
+    // Build address data structure
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(SERVER_PORT);
+
+    if ((listen_sock = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket failed");
+        exit(1);
+    }
+
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuseport && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        exit(1);
+    }
+    tune_socket(listen_sock, profile);
+
+    if (bind(listen_sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        perror("bind failed");
+        exit(1);
+    }
+
+    if (tune_listen(listen_sock, &listen_opts) < 0) {
+        perror("listen failed");
+        exit(1);
+    }
+
+    if (set_nonblocking(listen_sock) < 0) {
+        perror("fcntl failed");
+        exit(1);
+    }
+    return listen_sock;
+}
+
+/*-------------------------------------------------
+ * Connections
+ *-------------------------------------------------*/
+
+// Queue b for c and wake its writer. Returns -1 if the slow-consumer
+// policy says the connection must go.
+static int conn_send(conn *c, struct msgbuf *b) {
+    int rc = outq_push(&c->tx, b, &limits);
+
+    if (rc < 0)
+        return -1;
+    if (rc == 0)
+        wake(c->s, c->idle);
+    return 0;
+}
+
+// Stop both coroutines: whichever is parked is woken to see closing.
+static void conn_close(conn *c) {
+    if (c->closing)
+        return;
+    c->closing = true;
+    shutdown(c->fd, SHUT_RDWR);
+    wake(c->s, c->in);
+    wake(c->s, c->out);
+    wake(c->s, c->idle);
+}
+
+// Drop one coroutine's hold on c; the last one out releases it.
+static void conn_put(conn *c) {
+    struct scheduler *s = c->s;
+
+    if (--c->refs > 0)
+        return;
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    s->conns[c->slot] = s->conns.back();
+    s->conns[c->slot]->slot = c->slot;
+    s->conns.pop_back();
+    __atomic_store_n(&s->count, (int)s->conns.size(), __ATOMIC_RELAXED);
+    __atomic_store_n(&owner_of[c->fd], 0, __ATOMIC_RELAXED);
+    conn_at[c->fd] = NULL;
+
+    frame_parser_reset(&c->rx);
+    outq_clear(&c->tx, c->fd);
+    METRIC_ADD(&s->metrics, closed, 1);
+    close(c->fd);
+    delete c;
+}
+
+// Called by the frame parser for every complete client message.
+static int on_message(void *arg, const char *msg, size_t len) {
+    conn *c = static_cast<conn *>(arg);
+    uint64_t start = metrics_path ? metrics_now() : 0;
+    int rc = 0;
+
+    if (len == 0)
+        return 0;   // keepalive
+    METRIC_ADD(&c->s->metrics, msgs_in, 1);
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", c->fd, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", c->fd, MAX_LINE, msg, len);
+    }
+    if (echo_mode) {
+        struct msgbuf *b = msgbuf_frame(msg, len);
+
+        rc = !b || conn_send(c, b) < 0;
+        if (b)
+            msgbuf_unref(b);
+    }
+    if (metrics_path)
+        metric_observe(&c->s->metrics.handle_ns, metrics_now() - start);
+    return rc;
+}
+
+// Called for every frame from a shared-memory client. A ring can't be
+// waited on with epoll, so each of those is served by a thread of its own
+// and replies go straight into its ring.
+static int shm_message(void *ctx, const char *msg, size_t len) {
+    struct shm_chan *ch = static_cast<struct shm_chan *>(ctx);
+
+    if (len == 0)
+        return 0;   // keepalive
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", ch->sock, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", ch->sock, MAX_LINE, msg, len);
+    }
+    return echo_mode ? shm_send_frame(ch, msg, len) < 0 : 0;
+}
+
+static thread_local char recv_buf[RECV_BUF];
+
+// Read frames until the peer goes away, parking whenever the socket is
+// drained. The receive buffer is shared by the thread's connections: it
+// holds nothing across a suspension.
+static task conn_reader(conn *c) {
+    while (!c->closing) {
+        ssize_t n = recv(c->fd, recv_buf, sizeof(recv_buf), 0);
+
+        if (n > 0) {
+            int rc;
+
+            METRIC_ADD(&c->s->metrics, bytes_in, n);
+            rc = frame_feed(&c->rx, recv_buf, n, on_message, c);
+            if (rc < 0)
+                printf("[Client %d] Bad frame: %s\n", c->fd, strerror(errno));
+            if (rc)
+                break;
+            // Send this read's replies now, as the other servers do. Left
+            // to the writer, they would wait until the socket is drained,
+            // and a client that never pauses would push them past the
+            // high watermark. Not while the writer waits for room.
+            if (!c->out && !outq_empty(&c->tx) && outq_flush(&c->tx, c->fd, &limits) < 0)
+                break;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            tune_after_read(c->fd, profile);
+            co_await readable(c);
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    if (!c->closing)
+        printf("[Client %d] Disconnected.\n", c->fd);
+    conn_close(c);
+    conn_put(c);
+}
+
+// Write queued output as it arrives, parking while there is none or
+// while the socket buffer is full.
+static task conn_writer(conn *c) {
+    while (!c->closing) {
+        int rc;
+
+        if (outq_empty(&c->tx)) {
+            co_await park{ &c->idle };
+            continue;
+        }
+        rc = outq_flush(&c->tx, c->fd, &limits);
+        if (rc < 0)
+            break;
+        if (rc == 0)
+            co_await writable(c);
+    }
+    if (!c->closing)
+        printf("[Client %d] Disconnected.\n", c->fd);
+    conn_close(c);
+    conn_put(c);
+}
+
+static void conn_open(struct scheduler *s, int fd) {
+    conn *c;
+
+    if (fd >= max_fds || !(c = new (std::nothrow) conn())) {
+        printf("Rejecting client %d: out of memory.\n", fd);
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->s = s;
+    c->refs = 2;
+    c->tx.totals = &s->metrics.out;
+    watch(s, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    c->slot = s->conns.size();
+    s->conns.push_back(c);
+    __atomic_store_n(&s->count, (int)s->conns.size(), __ATOMIC_RELAXED);
+    conn_at[fd] = c;
+    __atomic_store_n(&owner_of[fd], s->id + 1, __ATOMIC_RELAXED);
+    METRIC_ADD(&s->metrics, accepted, 1);
+    if (!quiet)
+        printf("New client connected: %d\n", fd);
+
+    conn_reader(c);
+    conn_writer(c);
+}
+
+static task acceptor(struct scheduler *s, pollable *listener) {
+    for (;;) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (fd >= 0)
+            conn_open(s, fd);
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            co_await readable(listener);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            perror("accept failed");
+    }
+}
+
+// Run whatever other threads posted to this scheduler.
+static task mailbox(struct scheduler *s) {
+    std::vector<std::function<void()>> work;
+    uint64_t n;
+
+    for (;;) {
+        if (read(s->mbox.fd, &n, sizeof(n)) < 0) {
+            co_await readable(&s->mbox);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> hold(s->mbox_lock);
+            work.swap(s->posted);
+        }
+        for (auto &fn : work)
+            fn();
+        work.clear();
+    }
+}
+
+/*-------------------------------------------------
+ * Operator commands
+ *-------------------------------------------------*/
+
+// Operator commands typed on STDIN:
+//   /all text              send to every client
+//   @fd[,fd...] text       send to the listed client sockets
+//   text                   send to the first active client
+enum target_kind { TARGET_NONE, TARGET_FIRST, TARGET_ALL, TARGET_LIST };
+
+#define COMMAND_USAGE "usage: /all message | @fd[,fd...] message\n"
+
+static enum target_kind parse_command(char *line, char **text, int *targets, int *ntargets) {
+    char *p = line;
+
+    *ntargets = 0;
+    *text = line;
+    if (strncmp(line, "/all", 4) == 0 && (line[4] == ' ' || line[4] == '\0')) {
+        *text = line + 4 + (line[4] == ' ');
+        return TARGET_ALL;
+    }
+    if (line[0] != '@')
+        return TARGET_FIRST;
+
+    do {
+        char *end;
+        long fd = strtol(p + 1, &end, 10);
+        if (end == p + 1 || fd < 0 || *ntargets == MAX_TARGETS) {
+            printf(COMMAND_USAGE);
+            return TARGET_NONE;
+        }
+        targets[(*ntargets)++] = (int)fd;
+        p = end;
+    } while (*p == ',');
+
+    if (*p != ' ' && *p != '\0') {
+        printf(COMMAND_USAGE);
+        return TARGET_NONE;
+    }
+    *text = p + (*p == ' ');
+    return TARGET_LIST;
+}
+
+// The payload is framed once; every scheduler that owns a target gets a
+// reference and sends it from its own thread.
+static void deliver(char *line) {
+    int targets[MAX_TARGETS];
+    int ntargets;
+    char *text;
+    enum target_kind kind = parse_command(line, &text, targets, &ntargets);
+    struct msgbuf *b;
+
+    if (kind == TARGET_NONE)
+        return;
+    if (!(b = msgbuf_frame(text, strlen(text)))) {
+        perror("malloc failed");
+        return;
+    }
+
+    if (kind == TARGET_ALL) {
+        for (int i = 0; i < num_schedulers; i++) {
+            struct scheduler *s = &schedulers[i];
+
+            if (__atomic_load_n(&s->count, __ATOMIC_RELAXED) == 0)
+                continue;
+            msgbuf_ref(b);
+            post(s, [s, b] {
+                for (size_t j = 0; j < s->conns.size(); j++) {
+                    conn *c = s->conns[j];
+                    if (!c->closing && conn_send(c, b) < 0)
+                        conn_close(c);
+                }
+                msgbuf_unref(b);
+            });
+        }
+    } else if (kind == TARGET_LIST) {
+        for (int i = 0; i < ntargets; i++) {
+            int fd = targets[i];
+            int owner = fd_owner(fd);
+
+            if (owner < 0) {
+                printf("Client %d is not connected.\n", fd);
+                continue;
+            }
+            msgbuf_ref(b);
+            struct scheduler *s = &schedulers[owner];
+            post(s, [s, fd, b] {
+                // The fd may have closed and been reused by another
+                // scheduler since it was looked up. Only its owner closes
+                // it, so once this check passes conn_at[fd] stays ours.
+                conn *c = fd_owner(fd) == s->id ? conn_at[fd] : NULL;
+                if (c && !c->closing && conn_send(c, b) < 0)
+                    conn_close(c);
+                msgbuf_unref(b);
+            });
+        }
+    } else {
+        for (int i = 0; i < num_schedulers; i++) {
+            struct scheduler *s = &schedulers[i];
+
+            if (__atomic_load_n(&s->count, __ATOMIC_RELAXED) == 0)
+                continue;
+            msgbuf_ref(b);
+            post(s, [s, b] {
+                if (!s->conns.empty() && !s->conns[0]->closing && conn_send(s->conns[0], b) < 0)
+                    conn_close(s->conns[0]);
+                msgbuf_unref(b);
+            });
+            break;
+        }
+    }
+    msgbuf_unref(b);
+}
+
+// Runs on scheduler 0. STDIN is watched level-triggered and read once
+// per wakeup, so it never has to be made non-blocking.
+static task operator_input(struct scheduler *s) {
+    char line[MAX_LINE], chunk[MAX_LINE];
+    int len = 0;
+    struct epoll_event ev;
+
+    s->input.fd = STDIN_FILENO;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s->input;
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+        perror("epoll_ctl STDIN failed");
+        co_return;
+    }
+    for (;;) {
+        ssize_t n;
+
+        co_await readable(&s->input);
+        n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] != '\n' && len < MAX_LINE - 1)
+                line[len++] = chunk[i];
+            if (chunk[i] == '\n') {
+                line[len] = '\0';
+                deliver(line);
+                len = 0;
+            }
+        }
+    }
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+}
+
+/*-------------------------------------------------
+ * Scheduler
+ *-------------------------------------------------*/
+
+static void scheduler_init(struct scheduler *s, int id, int listen_sock, int local_sock) {
+    s->id = id;
+    s->listener.fd = listen_sock;
+    s->local.fd = local_sock;
+    if ((s->epfd = epoll_create1(0)) < 0 ||
+        (s->mbox.fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("scheduler setup failed");
+        exit(1);
+    }
+    watch(s, &s->listener, EPOLLIN | EPOLLET);
+    watch(s, &s->mbox, EPOLLIN | EPOLLET);
+    if (local_sock >= 0)
+        watch(s, &s->local, EPOLLIN | EPOLLET);
+    if (metrics_path)
+        metrics_register(&s->metrics);
+}
+
+static void *scheduler_loop(void *arg) {
+    struct scheduler *s = static_cast<struct scheduler *>(arg);
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<std::coroutine_handle<>> batch;
+
+    // Pinned before the first frame is allocated, so connection state
+    // comes from this CPU's node.
+    affinity_enter(placement_cpu(&placement, s->id));
+    acceptor(s, &s->listener);
+    if (s->local.fd >= 0)
+        acceptor(s, &s->local);
+    mailbox(s);
+    if (s->id == 0)
+        operator_input(s);
+
+    for (;;) {
+        int n = epoll_wait(s->epfd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait failed");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            pollable *p = static_cast<pollable *>(events[i].data.ptr);
+            uint32_t e = events[i].events;
+            std::coroutine_handle<> in, out;
+
+            // Take both waiters before resuming either: the reader may
+            // finish and release the connection, but never while the
+            // writer is still parked on it.
+            if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                std::swap(in, p->in);
+            if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                std::swap(out, p->out);
+            if (in)
+                in.resume();
+            if (out)
+                out.resume();
+        }
+        while (!s->ready.empty()) {
+            batch.swap(s->ready);
+            for (auto h : batch)
+                h.resume();
+            batch.clear();
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-w schedulers] [-e] [-q]\n"
+                    "       [-H high-watermark] [-L low-watermark] [-P drop|close]\n"
+                    "       [-p default|latency|throughput]\n"
+                    "       [-b backlog] [-A defer-accept-secs] [-F fastopen-queue]\n"
+                    "       [-M metrics-socket-path] [-U local-socket-path]\n"
+                    "       [-c cpu-list|auto] [-n steer-netdev]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt, workers = 1, listen_sock, local_sock = -1;
+
+    while ((opt = getopt(argc, argv, "w:eqH:L:P:p:b:A:F:M:U:c:n:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1 || workers > MAX_SCHEDULERS)
+                usage(argv[0]);
+            break;
+        case 'e':
+            echo_mode = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'H':
+            limits.high = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            limits.low = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            if (strcmp(optarg, "drop") == 0)
+                limits.policy = OUTQ_DROP;
+            else if (strcmp(optarg, "close") == 0)
+                limits.policy = OUTQ_CLOSE;
+            else
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (tune_parse(optarg, &profile) < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            listen_opts.backlog = atoi(optarg);
+            break;
+        case 'A':
+            listen_opts.defer_secs = atoi(optarg);
+            break;
+        case 'F':
+            listen_opts.fastopen = atoi(optarg);
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        case 'c':
+            if (placement_parse(&placement, optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            steer_dev = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (steer_dev && !placement.count) {
+        fprintf(stderr, "-n needs -c to say where to steer to\n");
+        usage(argv[0]);
+    }
+
+    max_fds = raise_fd_limit();
+    if (limits.low > limits.high)
+        limits.low = limits.high;
+    owner_of = static_cast<int *>(calloc(max_fds, sizeof(int)));
+    conn_at = static_cast<conn **>(calloc(max_fds, sizeof(conn *)));
+    if (!owner_of || !conn_at) {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    // The TCP port is taken first: if another server holds it, its local
+    // sockets are left alone.
+    listen_sock = make_listener(workers > 1);
+    if (!local_path)
+        local_path = local_default_path();
+    if (*local_path) {
+        if ((local_sock = local_listen(local_path, &listen_opts)) < 0 ||
+            shm_serve(local_path, shm_message) < 0) {
+            perror("local listener failed");
+            exit(1);
+        }
+        printf("Local clients: %s (UNIX socket), %s" SHM_SUFFIX " (shared memory)\n",
+               local_path, local_path);
+    }
+
+    // Scheduler 0 also accepts the local UNIX-domain clients.
+    num_schedulers = workers;
+    for (int i = 0; i < workers; i++)
+        scheduler_init(&schedulers[i], i, i == 0 ? listen_sock : make_listener(1),
+                       i == 0 ? local_sock : -1);
+    if (placement.count) {
+        printf("Schedulers pinned to %d CPU%s, memory on their nodes\n",
+               placement.count, placement.count > 1 ? "s" : "");
+        if (steer_reuseport(listen_sock, &placement, workers) < 0)
+            perror("reuseport steering failed");
+    }
+    if (steer_dev)
+        steer_rx(steer_dev, &placement);
+
+    printf("Coroutine Server (epoll, %d scheduler%s) listening on port %d, up to %d descriptors...\n",
+           workers, workers > 1 ? "s" : "", SERVER_PORT, max_fds);
+    if (metrics_path) {
+        if (metrics_serve(metrics_path, NULL) < 0) {
+            perror("metrics socket failed");
+            exit(1);
+        }
+        printf("Serving metrics on %s\n", metrics_path);
+    }
+
+    for (int i = 1; i < workers; i++) {
+        if (pthread_create(&schedulers[i].tid, NULL, scheduler_loop, &schedulers[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    scheduler_loop(&schedulers[0]);
+    return 0;
+}
@@ -1,29 +1,205 @@
 // server_event.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
+#include "affinity.h"
+#include "framing.h"
+#include "local.h"
+#include "metrics.h"
+#include "outq.h"
+#include "pool.h"
+#include "timer.h"
+#include "tune.h"
+#include "uring.h"
 
 #define SERVER_PORT  5432
-#define MAX_PENDING  5
-#define MAX_LINE     256
-#define MAX_CLIENTS  10   // support up to 10 clients
+#define MAX_PENDING  SOMAXCONN  // load tests open connections in bursts
+#define MAX_LINE     256  // operator lines typed on STDIN
+#define MAX_TARGETS  128  // sockets named in one @fd,fd,... command
+#define RECV_BUF     65536
+#define MAX_CLIENTS  10   // select backend: support up to 10 clients
+#define MAX_EVENTS   256  // epoll backend: events harvested per epoll_wait
+#define MAX_REACTORS 256  // epoll/io_uring backends: upper bound for -w
+#define URING_ENTRIES 4096 // io_uring backend: submission queue size
+#define URING_BUFS   4096  // io_uring backend: provided receive buffers (power of 2)
+#define URING_BUF_SIZE 2048
+#define URING_BGID   1
+#define CONN_SLAB    256   // connections allocated per slab
+#define RX_CHUNK     4096  // pooled buffer for a frame split across reads
+#define RX_SLAB      64
+#define DRAIN_TICKS  (10000 / TIMER_TICK_MS)  // epoll: time a half-closed peer gets to
+                                           // take its queued output, without -D
 
-int main() {
-    struct sockaddr_in sin;
-    int listen_sock, client_socks[MAX_CLIENTS];
-    socklen_t addr_len = sizeof(sin);
-    fd_set readfds;
-    int max_fd;
-    char buf[MAX_LINE];
+// Event backends. select is kept as the reference implementation;
+// epoll (edge-triggered) is the default and scales past FD_SETSIZE;
+// io_uring removes the per-message readiness and recv system calls.
+enum backend { BACKEND_SELECT, BACKEND_EPOLL, BACKEND_URING };
+
+// Active connections are kept in a dense array so that removal is a
+// swap with the last entry; each connection records its own slot.
+struct client_set {
+    int *fds;
+    int count;    // written by the owning reactor only
+    int cap;
+};
+
+// Each reactor owns a listener, an event queue and a client set, so
+// the hot path shares nothing with other reactors. Operator lines for a
+// client of another reactor travel through that reactor's mailbox pipe.
+struct reactor {
+    int id;
+    enum backend backend;
+    int listen_sock;
+    int local_sock;         // reactor 0: UNIX-domain listener, or -1
+    int epfd;
+    int mbox[2];
+    struct client_set cs;
+    struct pool conn_pool;  // struct conn for every client of this reactor
+    struct pool parser_pool;    // frame parsers, attached only mid-frame
+    struct pool rx_pool;    // partial-frame buffers, attached only mid-frame
+    struct pool outq_pool;  // output queues, attached on first output
+    struct timer_wheel timers;  // idle, keepalive and write deadlines
+    uint64_t now;           // tick, sampled once per loop iteration
+    pthread_t tid;
+    // Written by the owner only; sampled by the stats thread (-s) and
+    // summed by metrics scrapes (-M).
+    unsigned long syscalls;
+    struct metrics metrics;
+};
+
+#define STAT_ADD(r, field, n) \
+    __atomic_store_n(&(r)->field, (r)->field + (n), __ATOMIC_RELAXED)
+
+static struct reactor reactors[MAX_REACTORS];
+static int num_reactors = 1;
+static int max_fds;
+
+// Per-client state, allocated from the owning reactor's pool on accept
+// and touched only by that reactor. An idle connection is just this: the
+// parser is attached only while a frame is split across reads, and the
+// output queue once the first reply is sent.
+struct conn {
+    struct frame_parser *rx;      // NULL unless mid-frame
+    struct outq *tx;              // NULL until the first output
+    struct conn_timer clock;
+    int fd;
+    int slot;                     // index in the owner's client_set, -1 once removed
+    unsigned char closing;        // epoll: 1 = the peer shut down its side, flushing then closing;
+                                  // io_uring: 1 = shut down, waiting for the final recv CQE;
+                                  // 2 = recv done, waiting for the in-flight SEND
+    unsigned char wait_out;       // io_uring: a POLLOUT request is in flight
+    unsigned char send_inflight;  // io_uring: a SEND for the queue head is in flight
+    unsigned char zc_copied;      // io_uring: the kernel copied a SEND_ZC anyway
+    unsigned zc_inflight;         // io_uring: SEND_ZC notifications still to come
+};
+
+// Connection table indexed directly by socket, so every lookup is O(1).
+// owner is also read by reactor 0 to route @fd commands; c is only
+// dereferenced by the owner. All zeroes is a free entry, so the table's
+// pages are only touched once their descriptors are used.
+struct conn_entry {
+    struct conn *c;
+    int owner;                    // reactor id + 1, or 0 while free
+    unsigned gen;                 // bumped as each connection on the fd opens
+};
+
+static struct conn_entry *conn_table;
+
+static inline struct conn *conn_of(int fd) {
+    return conn_table[fd].c;
+}
+
+// The reactor that owns fd, or -1.
+static inline int conn_owner(int fd) {
+    return fd < max_fds ? __atomic_load_n(&conn_table[fd].owner, __ATOMIC_RELAXED) - 1 : -1;
+}
+
+// True if fd is a live client of reactor r.
+static inline int conn_active(struct reactor *r, int fd) {
+    return fd >= 0 && fd < max_fds && conn_table[fd].owner == r->id + 1 &&
+           conn_table[fd].c && conn_table[fd].c->slot >= 0;
+}
+
+// Output queue watermarks and slow-consumer policy (-H, -L, -P).
+static struct outq_limits limits = { 4 << 20, 1 << 20, OUTQ_DROP };
+
+// Writes of at least this many bytes are sent zero-copy (-z); 0 = never.
+static size_t zerocopy_min;
+
+// UNIX socket serving metrics scrapes (-M); NULL = not served, and
+// message handling is then not timed.
+static const char *metrics_path;
+
+// Socket tuning profile (-p), applied to the listener.
+static enum tune_profile profile;
+
+// CPUs the reactors are pinned to (-c), and the network device whose
+// interrupts and RPS are steered onto them (-n); NULL = leave it alone.
+static struct placement placement;
+static const char *steer_dev;
+
+// Path of the UNIX-domain listener for local clients (-U); its
+// shared-memory handshake socket is next to it. NULL = the per-user
+// local_default_path(), empty = TCP only.
+static const char *local_path;
+
+// Accept queue depth and optional listener features (-b, -A, -F).
+static struct listen_opts listen_opts = { MAX_PENDING, 0, 0 };
 
-    // Initialize client sockets
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_socks[i] = -1;
+// Load-test switches: echo every frame back (-e), don't print it (-q).
+static int echo_mode;
+static int quiet;
+
+// Connection deadlines (-I, -K, -D) and the keepalive ping: an empty
+// frame, shared by every connection and never freed.
+static struct timeouts timeouts;
+static struct msgbuf *ping;
+
+// Partial operator line read from STDIN, shared by both backends.
+static char stdin_line[MAX_LINE];
+static int stdin_len;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Raise the open file limit to the hard maximum so the epoll backend
+// is bounded by the kernel rather than the default of 1024 descriptors.
+static int raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("getrlimit failed");
+        exit(1);
     }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit failed");
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return (int)rl.rlim_cur;
+}
+
+// With reuseport set, every reactor binds its own listener to the port
+// and the kernel load-balances incoming connections between them.
+static int make_listener(int reuseport) {
+    struct sockaddr_in sin;
+    int listen_sock, on = 1;
 
     // Build address data structure
     bzero((char *)&sin, sizeof(sin));
@@ -36,17 +212,343 @@ int main() {
         exit(1);
     }
 
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuseport && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        exit(1);
+    }
+    tune_socket(listen_sock, profile);
+
     if (bind(listen_sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
         perror("bind failed");
         exit(1);
     }
 
-    if (listen(listen_sock, MAX_PENDING) < 0) {
+    if (tune_listen(listen_sock, &listen_opts) < 0) {
         perror("listen failed");
         exit(1);
     }
 
-    printf("Event-based Server listening on port %d...\n", SERVER_PORT);
+    return listen_sock;
+}
+
+// Read whatever is available on STDIN and hand each complete line,
+// without its newline, to deliver(). Returns 0 on EOF so the caller can
+// stop watching STDIN.
+static int read_stdin_lines(void (*deliver)(char *line, void *ctx), void *ctx) {
+    char chunk[MAX_LINE];
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+
+    if (n <= 0)
+        return n < 0 && errno == EAGAIN;
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (chunk[i] != '\n' && stdin_len < MAX_LINE - 1)
+            stdin_line[stdin_len++] = chunk[i];
+        if (chunk[i] == '\n') {
+            stdin_line[stdin_len] = '\0';
+            deliver(stdin_line, ctx);
+            stdin_len = 0;
+        }
+    }
+    return 1;
+}
+
+struct msg_ctx {
+    struct reactor *r;
+    int sock;
+};
+
+static void uring_kick_send(struct reactor *r, int fd);
+static void conn_output(struct reactor *r, int fd, int rc);
+
+// The connection's output queue, attached on its first output and kept
+// until it closes, since zero-copy sends are numbered per socket. NULL if
+// the pool can't grow.
+static struct outq *conn_tx(struct reactor *r, int sock) {
+    struct conn *c = conn_of(sock);
+
+    if (!c->tx && (c->tx = pool_get(&r->outq_pool)) != NULL) {
+        memset(c->tx, 0, sizeof(*c->tx));
+        c->tx->totals = &r->metrics.out;
+        if (zerocopy_min && r->backend == BACKEND_EPOLL)
+            outq_zerocopy(c->tx, sock, zerocopy_min);
+    }
+    return c->tx;
+}
+
+// Send a message back to its sender (-e). The connection is not closed
+// here because the parser is still walking its receive buffer; non-zero
+// makes client_input() report it for closing instead.
+static int echo_message(struct reactor *r, int sock, const char *msg, size_t len) {
+    struct msgbuf *b;
+    int rc;
+
+    if (r->backend == BACKEND_SELECT)
+        return frame_send(sock, msg, len) < 0;
+
+    b = msgbuf_frame(msg, len);
+    if (!b)
+        return 1;
+    if (r->backend == BACKEND_URING) {
+        rc = conn_tx(r, sock) ? outq_push(conn_of(sock)->tx, b, &limits) : -1;
+        if (rc == 0) {
+            conn_output(r, sock, 0);
+            uring_kick_send(r, sock);
+        }
+    } else {
+        STAT_ADD(r, syscalls, 1);
+        rc = conn_tx(r, sock) ? outq_send(conn_of(sock)->tx, sock, b, &limits) : -1;
+        if (rc >= 0)
+            conn_output(r, sock, rc);
+    }
+    msgbuf_unref(b);
+    return rc < 0;
+}
+
+// Called by the frame parser for every complete client message.
+static int on_message(void *arg, const char *msg, size_t len) {
+    struct msg_ctx *ctx = arg;
+    uint64_t start = metrics_path ? metrics_now() : 0;
+    int rc;
+
+    if (len == 0)
+        return 0;   // keepalive
+    METRIC_ADD(&ctx->r->metrics, msgs_in, 1);
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", ctx->sock, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", ctx->sock, MAX_LINE, msg, len);
+    }
+    rc = echo_mode ? echo_message(ctx->r, ctx->sock, msg, len) : 0;
+    if (metrics_path)
+        metric_observe(&ctx->r->metrics.handle_ns, metrics_now() - start);
+    return rc;
+}
+
+// Called for every frame from a shared-memory client. Each of those has
+// a thread of its own, so replies go straight into its ring.
+static int shm_message(void *ctx, const char *msg, size_t len) {
+    struct shm_chan *ch = ctx;
+
+    if (len == 0)
+        return 0;   // keepalive
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", ch->sock, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", ch->sock, MAX_LINE, msg, len);
+    }
+    return echo_mode ? shm_send_frame(ch, msg, len) < 0 : 0;
+}
+
+// Feed received bytes into the socket's parser. A read may end mid-frame
+// or hold many frames; -1 means the stream is corrupt or the connection
+// failed while echoing, and it must be closed.
+static int client_input(struct reactor *r, int sock, const char *data, size_t n) {
+    struct msg_ctx ctx = { r, sock };
+    struct conn *c = conn_of(sock);
+    struct frame_parser local = { .pool = &r->rx_pool };
+    struct frame_parser *p = c->rx ? c->rx : &local;
+    int rc;
+
+    METRIC_ADD(&r->metrics, bytes_in, n);
+    c->clock.last_rx = r->now;
+    rc = frame_feed(p, data, n, on_message, &ctx);
+
+    // Reads of whole frames need no parser kept; one split across reads
+    // moves into a pooled one until the frame completes.
+    if (p == &local && frame_pending(&local)) {
+        if (rc == 0 && (c->rx = pool_get(&r->parser_pool)) != NULL) {
+            *c->rx = local;
+        } else {
+            frame_parser_reset(&local);
+            if (rc == 0) {
+                errno = ENOMEM;
+                rc = -1;
+            }
+        }
+    } else if (p == c->rx && !frame_pending(p)) {
+        pool_put(&r->parser_pool, p);
+        c->rx = NULL;
+    }
+    if (rc < 0)
+        printf("[Client %d] Bad frame: %s\n", sock, strerror(errno));
+    return rc ? -1 : 0;
+}
+
+// Operator commands typed on STDIN:
+//   /all text              send to every client
+//   @fd[,fd...] text       send to the listed client sockets
+//   /file @fd[,fd...] path stream a file to the listed client sockets
+//   text                   send to the first active client
+enum target_kind { TARGET_NONE, TARGET_FIRST, TARGET_ALL, TARGET_LIST, TARGET_FILE };
+
+#define COMMAND_USAGE "usage: /all message | @fd[,fd...] message | /file @fd[,fd...] path\n"
+
+static enum target_kind parse_command(char *line, char **text, int *targets, int *ntargets) {
+    char *p = line;
+
+    *ntargets = 0;
+    *text = line;
+    if (strncmp(line, "/all", 4) == 0 && (line[4] == ' ' || line[4] == '\0')) {
+        *text = line + 4 + (line[4] == ' ');
+        return TARGET_ALL;
+    }
+    if (strncmp(line, "/file ", 6) == 0) {
+        if (parse_command(line + 6, text, targets, ntargets) == TARGET_LIST && **text)
+            return TARGET_FILE;
+        printf(COMMAND_USAGE);
+        return TARGET_NONE;
+    }
+    if (line[0] != '@')
+        return TARGET_FIRST;
+
+    do {
+        char *end;
+        long fd = strtol(p + 1, &end, 10);
+        if (end == p + 1 || fd < 0 || *ntargets == MAX_TARGETS) {
+            printf(COMMAND_USAGE);
+            return TARGET_NONE;
+        }
+        targets[(*ntargets)++] = (int)fd;
+        p = end;
+    } while (*p == ',');
+
+    if (*p != ' ' && *p != '\0') {
+        printf(COMMAND_USAGE);
+        return TARGET_NONE;
+    }
+    *text = p + (*p == ' ');
+    return TARGET_LIST;
+}
+
+static void client_set_init(struct reactor *r) {
+    r->cs.fds = NULL;
+    r->cs.count = 0;
+    r->cs.cap = 0;
+    pool_init(&r->conn_pool, sizeof(struct conn), CONN_SLAB);
+    pool_init(&r->parser_pool, sizeof(struct frame_parser), CONN_SLAB);
+    pool_init(&r->rx_pool, RX_CHUNK, RX_SLAB);
+    pool_init(&r->outq_pool, sizeof(struct outq), CONN_SLAB);
+    r->now = timer_now();
+    timer_wheel_init(&r->timers, r->now);
+}
+
+static int client_add(struct client_set *cs, int fd) {
+    if (cs->count == cs->cap) {
+        int ncap = cs->cap ? cs->cap * 2 : 64;
+        int *nfds = realloc(cs->fds, sizeof(int) * ncap);
+        if (!nfds)
+            return -1;
+        cs->fds = nfds;
+        cs->cap = ncap;
+    }
+    conn_of(fd)->slot = cs->count;
+    cs->fds[cs->count] = fd;
+    __atomic_store_n(&cs->count, cs->count + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void client_remove(struct client_set *cs, int fd) {
+    int slot = conn_of(fd)->slot;
+    int last = cs->fds[cs->count - 1];
+
+    __atomic_store_n(&cs->count, cs->count - 1, __ATOMIC_RELAXED);
+    cs->fds[slot] = last;
+    conn_of(last)->slot = slot;
+    conn_of(fd)->slot = -1;
+}
+
+// Give a newly accepted socket its state and make it a client of r.
+// Returns -1 (with the socket left open) if either allocation fails.
+static int client_open(struct reactor *r, int sock) {
+    struct conn *c = pool_get(&r->conn_pool);
+
+    if (!c)
+        return -1;
+    memset(c, 0, sizeof(*c));
+    c->fd = sock;
+    __atomic_store_n(&conn_table[sock].gen, conn_table[sock].gen + 1, __ATOMIC_RELAXED);
+    c->clock.last_rx = r->now;
+    c->clock.last_tx = r->now;
+    conn_table[sock].c = c;
+    if (client_add(&r->cs, sock) < 0) {
+        conn_table[sock].c = NULL;
+        pool_put(&r->conn_pool, c);
+        return -1;
+    }
+    __atomic_store_n(&conn_table[sock].owner, r->id + 1, __ATOMIC_RELAXED);
+    METRIC_ADD(&r->metrics, accepted, 1);
+    if (timeouts_enabled(&timeouts))
+        timer_add(&r->timers, &c->clock.timer, r->now + 1);
+    return 0;
+}
+
+static void client_release(struct reactor *r, int sock) {
+    struct conn *c = conn_of(sock);
+
+    timer_del(&r->timers, &c->clock.timer);
+    if (c->rx) {
+        frame_parser_reset(c->rx);
+        pool_put(&r->parser_pool, c->rx);
+    }
+    if (c->tx) {
+        outq_clear(c->tx, sock);
+        pool_put(&r->outq_pool, c->tx);
+    }
+    __atomic_store_n(&conn_table[sock].owner, 0, __ATOMIC_RELAXED);
+    conn_table[sock].c = NULL;
+    pool_put(&r->conn_pool, c);
+    METRIC_ADD(&r->metrics, closed, 1);
+    close(sock);
+}
+
+/*-------------------------------------------------
+ * select backend
+ *-------------------------------------------------*/
+
+static void select_deliver(char *line, void *ctx) {
+    struct client_set *cs = ctx;
+    int targets[MAX_TARGETS];
+    int ntargets;
+    char *text;
+    enum target_kind kind = parse_command(line, &text, targets, &ntargets);
+
+    if (kind == TARGET_FILE) {
+        printf("/file needs the epoll or io_uring backend.\n");
+        return;
+    }
+    for (int i = 0; i < cs->count; i++) {
+        int match = kind == TARGET_ALL || kind == TARGET_FIRST;
+
+        for (int j = 0; j < ntargets; j++)
+            match |= targets[j] == cs->fds[i];
+        if (!match)
+            continue;
+        frame_send(cs->fds[i], text, strlen(text));
+        if (kind == TARGET_FIRST)
+            break; // only send to one
+    }
+}
+
+static void metrics_start(int mailboxes);
+
+static void run_select(int listen_sock) {
+    struct reactor *r = &reactors[0];
+    struct client_set *cs = &r->cs;
+    struct sockaddr_in sin;
+    socklen_t addr_len = sizeof(sin);
+    fd_set readfds;
+    int max_fd;
+    int stdin_open = 1;
+    static char buf[RECV_BUF];
+
+    client_set_init(r);
+
+    printf("Event-based Server (select) listening on port %d...\n", SERVER_PORT);
+    metrics_start(0);
 
     while (1) {
         FD_ZERO(&readfds);
@@ -56,19 +558,20 @@ int main() {
         max_fd = listen_sock;
 
         // Add STDIN
-        FD_SET(STDIN_FILENO, &readfds);
-        if (STDIN_FILENO > max_fd) max_fd = STDIN_FILENO;
+        if (stdin_open) {
+            FD_SET(STDIN_FILENO, &readfds);
+            if (STDIN_FILENO > max_fd) max_fd = STDIN_FILENO;
+        }
 
         // Add active clients
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_socks[i] != -1) {
-                FD_SET(client_socks[i], &readfds);
-                if (client_socks[i] > max_fd)
-                    max_fd = client_socks[i];
-            }
+        for (int i = 0; i < cs->count; i++) {
+            FD_SET(cs->fds[i], &readfds);
+            if (cs->fds[i] > max_fd)
+                max_fd = cs->fds[i];
         }
 
         // Wait for activity
+        STAT_ADD(r, syscalls, 1);
         if (select(max_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
             perror("select error");
             continue;
@@ -76,18 +579,12 @@ int main() {
 
         // New connection
         if (FD_ISSET(listen_sock, &readfds)) {
+            STAT_ADD(r, syscalls, 1);
             int new_sock = accept(listen_sock, (struct sockaddr *)&sin, &addr_len);
             if (new_sock >= 0) {
                 printf("New client connected. Socket: %d\n", new_sock);
-                int added = 0;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (client_socks[i] == -1) {
-                        client_socks[i] = new_sock;
-                        added = 1;
-                        break;
-                    }
-                }
-                if (!added) {
+                if (cs->count == MAX_CLIENTS || new_sock >= FD_SETSIZE ||
+                    client_open(r, new_sock) < 0) {
                     printf("Too many clients. Closing socket %d\n", new_sock);
                     close(new_sock);
                 }
@@ -95,36 +592,1139 @@ int main() {
         }
 
         // Input from server STDIN
-        if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (fgets(buf, sizeof(buf), stdin) != NULL) {
-                buf[MAX_LINE - 1] = '\0';
-
-                // Send to one random client (or first active client)
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (client_socks[i] != -1) {
-                        send(client_socks[i], buf, strlen(buf) + 1, 0);
-                        break; // only send to one
-                    }
+        if (stdin_open && FD_ISSET(STDIN_FILENO, &readfds))
+            stdin_open = read_stdin_lines(select_deliver, cs);
+
+        // Handle messages from clients; backwards, as removal moves the
+        // last client into the freed slot
+        for (int i = cs->count - 1; i >= 0; i--) {
+            int sock = cs->fds[i];
+            if (FD_ISSET(sock, &readfds)) {
+                int bytes = recv(sock, buf, sizeof(buf), 0);
+                STAT_ADD(r, syscalls, 1);
+                if (bytes <= 0 || client_input(r, sock, buf, bytes) < 0) {
+                    printf("[Client %d] Disconnected.\n", sock);
+                    client_remove(cs, sock);
+                    client_release(r, sock);
                 }
             }
         }
+    }
+}
 
-        // Handle messages from clients
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            int sock = client_socks[i];
-            if (sock != -1 && FD_ISSET(sock, &readfds)) {
-                int bytes = recv(sock, buf, sizeof(buf), 0);
-                if (bytes <= 0) {
-                    printf("[Client %d] Disconnected.\n", sock);
-                    close(sock);
-                    client_socks[i] = -1;
-                } else {
-                    buf[MAX_LINE - 1] = '\0';
-                    printf("[Client %d]: %s\n", sock, buf);
+/*-------------------------------------------------
+ * Reactors (epoll and io_uring, one per worker thread)
+ *-------------------------------------------------*/
+
+static void epoll_close(struct reactor *r, int sock);
+static void uring_request_close(struct reactor *r, int sock);
+static void uring_arm_pollout(struct reactor *r, int fd);
+
+// Record output for fd; rc is what outq_send() or outq_flush() returned,
+// with 0 for a frame the io_uring backend has only queued. Output that
+// stays queued starts the write deadline, pulling the timer in if it is
+// armed for later.
+static void conn_output(struct reactor *r, int fd, int rc) {
+    struct conn_timer *ct = &conn_of(fd)->clock;
+
+    ct->last_tx = r->now;
+    if (rc > 0) {
+        ct->tx_since = 0;
+    } else if (!ct->tx_since) {
+        ct->tx_since = r->now;
+        if (timeouts.write && (!timer_pending(&ct->timer) ||
+                               ct->timer.expires > r->now + timeouts.write))
+            timer_add(&r->timers, &ct->timer, r->now + timeouts.write);
+    }
+}
+
+// Queue a frame on a client's output queue. Nothing blocks: bytes the
+// socket will not take now are written when it becomes writable again.
+// A peer that falls too far behind is handled by the -P policy. The
+// io_uring backend only queues here; the send itself becomes an SQE that
+// goes out with the reactor's next io_uring_enter.
+static void reactor_send(struct reactor *r, int sock, struct msgbuf *b) {
+    struct conn *c = conn_of(sock);
+    int rc;
+
+    if (c->closing)
+        return;
+    if (r->backend == BACKEND_URING) {
+        rc = conn_tx(r, sock) ? outq_push(c->tx, b, &limits) : -1;
+        if (rc == 0) {
+            conn_output(r, sock, 0);
+            uring_kick_send(r, sock);
+        }
+    } else {
+        STAT_ADD(r, syscalls, 1);
+        rc = conn_tx(r, sock) ? outq_send(c->tx, sock, b, &limits) : -1;
+        if (rc >= 0)
+            conn_output(r, sock, rc);
+    }
+    if (rc < 0) {
+        printf("[Client %d] Slow consumer or send error, closing.\n", sock);
+        if (r->backend == BACKEND_URING)
+            uring_request_close(r, sock);
+        else
+            epoll_close(r, sock);
+    }
+}
+
+// A connection's timer fired: close it if a deadline passed, ping it if
+// it has been quiet, and re-arm for whatever is due next.
+static void conn_expired(struct timer *t, void *ctx) {
+    struct reactor *r = ctx;
+    struct conn *c = timer_entry(t, struct conn, clock.timer);
+    int fd = c->fd;
+    enum timer_action action;
+    uint64_t next;
+
+    if (c->closing && r->backend != BACKEND_URING) {
+        printf("[Client %d] Output not taken after the peer closed, closing.\n", fd);
+        epoll_close(r, fd);
+        return;
+    }
+    action = conn_timer_check(&c->clock, &timeouts, r->now, &next);
+    if (action == TIMER_PING) {
+        reactor_send(r, fd, ping);
+        if (!conn_active(r, fd) || c->closing)
+            return;     // the ping failed and closed it
+        action = conn_timer_check(&c->clock, &timeouts, r->now, &next);
+    }
+
+    if (action == TIMER_IDLE || action == TIMER_WRITE) {
+        printf("[Client %d] %s, closing.\n", fd,
+               action == TIMER_IDLE ? "Idle timeout" : "Write deadline missed");
+        if (r->backend == BACKEND_URING)
+            uring_request_close(r, fd);
+        else
+            epoll_close(r, fd);
+    } else if (action == TIMER_REARM) {
+        timer_add(&r->timers, t, next);
+    }
+}
+
+// Report a file stream's progress every 10% and when it completes.
+static void stream_progress(struct filebuf *f) {
+    int pct = (int)(f->sent * 100 / f->size);
+
+    if (pct / 10 <= f->reported)
+        return;
+    f->reported = pct / 10;
+    printf("[Client %d] %s: %lld of %lld bytes sent (%d%%)%s\n", f->target, f->name,
+           (long long)f->sent, (long long)f->size, pct, f->sent == f->size ? ", done." : "");
+}
+
+// Queue a file for a client as frames of up to FRAME_MAX bytes. Each
+// header is a small buffer; each payload is a file range that
+// outq_flush() writes with sendfile(), a chunk at a time, so a large file
+// never blocks the loop or goes through user space. A stream the -P
+// policy cuts off still ends on a frame boundary.
+static void reactor_stream(struct reactor *r, int sock, struct filebuf *f) {
+    struct conn *c = conn_of(sock);
+    off_t off = 0;
+    int rc;
+
+    if (c->closing)
+        return;
+    f->target = sock;
+    f->progress = stream_progress;
+    printf("[Client %d] Streaming %s (%lld bytes).\n", sock, f->name, (long long)f->size);
+
+    do {
+        size_t len = f->size - off < FRAME_MAX ? (size_t)(f->size - off) : FRAME_MAX;
+        struct msgbuf *hdr = msgbuf_new(FRAME_HDR);
+
+        if (!hdr) {
+            rc = -1;
+            break;
+        }
+        frame_put_header(hdr->data, (uint32_t)len);
+        rc = conn_tx(r, sock) ? outq_push(c->tx, hdr, &limits) : -1;
+        msgbuf_unref(hdr);
+        if (rc == 0 && len > 0)
+            rc = outq_push_file(c->tx, f, off, len);
+        off += len;
+    } while (rc == 0 && off < f->size);
+
+    if (rc > 0)
+        printf("[Client %d] %s: output queue full, stream cut short.\n", sock, f->name);
+    if (rc >= 0 && r->backend == BACKEND_URING) {
+        conn_output(r, sock, 0);
+        uring_kick_send(r, sock);
+        return;
+    }
+    if (rc >= 0) {
+        STAT_ADD(r, syscalls, 1);
+        if ((rc = outq_flush(c->tx, sock, &limits)) >= 0) {
+            conn_output(r, sock, rc);
+            return;
+        }
+    }
+    printf("[Client %d] Send error, closing.\n", sock);
+    if (r->backend == BACKEND_URING)
+        uring_request_close(r, sock);
+    else
+        epoll_close(r, sock);
+}
+
+// Send to every client of this reactor. Walking backwards keeps the
+// iteration valid if reactor_send() closes a slow consumer, since removal
+// moves the last entry into the freed slot.
+static void reactor_send_all(struct reactor *r, struct msgbuf *b) {
+    for (int i = r->cs.count - 1; i >= 0; i--)
+        reactor_send(r, r->cs.fds[i], b);
+}
+
+// Mailbox records carry a reference to an already framed buffer, so a
+// broadcast is formatted once however many reactors and clients get it,
+// or to a file to stream. A record is far below PIPE_BUF, so every write
+// is atomic.
+#define MAIL_FIRST  -1      // the reactor's first client
+#define MAIL_ALL    -2      // every client of the reactor
+
+struct mail {
+    struct msgbuf *buf;     // NULL for a file
+    struct filebuf *file;
+    int target;             // client socket, MAIL_FIRST or MAIL_ALL
+};
+
+static void mail_post(struct reactor *to, struct msgbuf *b, int target) {
+    struct mail m = { msgbuf_ref(b), NULL, target };
+
+    if (write(to->mbox[1], &m, sizeof(m)) != sizeof(m)) {
+        perror("mailbox write");
+        msgbuf_unref(b);
+    }
+}
+
+static void mail_post_file(struct reactor *to, struct filebuf *f, int target) {
+    struct mail m = { NULL, filebuf_ref(f), target };
+
+    if (write(to->mbox[1], &m, sizeof(m)) != sizeof(m)) {
+        perror("mailbox write");
+        filebuf_unref(f);
+    }
+}
+
+static void reactor_mailbox(struct reactor *r) {
+    struct mail recs[64];
+    ssize_t n;
+
+    while ((n = read(r->mbox[0], recs, sizeof(recs))) > 0) {
+        for (int i = 0; i < n / (ssize_t)sizeof(struct mail); i++) {
+            struct mail *m = &recs[i];
+
+            if (m->file) {
+                if (conn_active(r, m->target))
+                    reactor_stream(r, m->target, m->file);
+                filebuf_unref(m->file);
+                continue;
+            }
+            if (m->target == MAIL_ALL)
+                reactor_send_all(r, m->buf);
+            else if (m->target == MAIL_FIRST && r->cs.count > 0)
+                reactor_send(r, r->cs.fds[0], m->buf);
+            else if (conn_active(r, m->target))
+                reactor_send(r, m->target, m->buf);
+            msgbuf_unref(m->buf);
+        }
+    }
+}
+
+// The file is opened here, once per client so each stream keeps its own
+// progress, and streamed by the reactor that owns the client.
+static void reactor_deliver_file(struct reactor *r, const char *path, int *targets, int ntargets) {
+    for (int i = 0; i < ntargets; i++) {
+        int fd = targets[i];
+        int owner = conn_owner(fd);
+        struct filebuf *f;
+
+        if (owner < 0) {
+            printf("Client %d is not connected.\n", fd);
+            continue;
+        }
+        if (!(f = filebuf_open(path))) {
+            printf("%s: %s\n", path, strerror(errno));
+            return;
+        }
+        if (owner == r->id && conn_active(r, fd))
+            reactor_stream(r, fd, f);
+        else
+            mail_post_file(&reactors[owner], f, fd);
+        filebuf_unref(f);
+    }
+}
+
+// Runs on reactor 0, which owns STDIN. The payload is framed once; local
+// clients get it directly and other reactors get a reference by mail.
+static void reactor_deliver(char *line, void *ctx) {
+    struct reactor *r = ctx;
+    int targets[MAX_TARGETS];
+    int ntargets;
+    char *text;
+    enum target_kind kind = parse_command(line, &text, targets, &ntargets);
+    struct msgbuf *b;
+
+    if (kind == TARGET_NONE)
+        return;
+    if (kind == TARGET_FILE) {
+        reactor_deliver_file(r, text, targets, ntargets);
+        return;
+    }
+    if (!(b = msgbuf_frame(text, strlen(text)))) {
+        perror("malloc failed");
+        return;
+    }
+
+    if (kind == TARGET_ALL) {
+        reactor_send_all(r, b);
+        for (int i = 0; i < num_reactors; i++) {
+            if (i != r->id && __atomic_load_n(&reactors[i].cs.count, __ATOMIC_RELAXED) > 0)
+                mail_post(&reactors[i], b, MAIL_ALL);
+        }
+    } else if (kind == TARGET_LIST) {
+        for (int i = 0; i < ntargets; i++) {
+            int fd = targets[i];
+            int owner = conn_owner(fd);
+
+            if (owner == r->id && conn_active(r, fd))
+                reactor_send(r, fd, b);
+            else if (owner >= 0)
+                mail_post(&reactors[owner], b, fd);
+            else
+                printf("Client %d is not connected.\n", fd);
+        }
+    } else if (r->cs.count > 0) {
+        reactor_send(r, r->cs.fds[0], b);
+    } else {
+        for (int i = 0; i < num_reactors; i++) {
+            if (__atomic_load_n(&reactors[i].cs.count, __ATOMIC_RELAXED) > 0) {
+                mail_post(&reactors[i], b, MAIL_FIRST);
+                break;
+            }
+        }
+    }
+    msgbuf_unref(b);
+}
+
+/*-------------------------------------------------
+ * epoll backend (edge-triggered)
+ *-------------------------------------------------*/
+
+static void epoll_close(struct reactor *r, int sock) {
+    printf("[Client %d] Disconnected.\n", sock);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, sock, NULL);
+    client_remove(&r->cs, sock);
+    client_release(r, sock);
+}
+
+// Accept until the backlog is empty; with EPOLLET no further
+// notification arrives for connections left in the queue. accept4()
+// returns each socket already non-blocking, saving a system call per
+// client when thousands reconnect at once.
+static void epoll_accept(struct reactor *r, int listen_sock) {
+    struct epoll_event ev;
+
+    while (1) {
+        int new_sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK);
+        STAT_ADD(r, syscalls, 1);
+        if (new_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed");
+            return;
+        }
+        if (new_sock >= max_fds || client_open(r, new_sock) < 0) {
+            printf("Too many clients. Closing socket %d\n", new_sock);
+            close(new_sock);
+            continue;
+        }
+
+        // EPOLLOUT is edge-triggered too, so it only fires when a full
+        // socket buffer drains and never needs to be toggled.
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = new_sock;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, new_sock, &ev) < 0) {
+            perror("epoll_ctl failed");
+            client_remove(&r->cs, new_sock);
+            client_release(r, new_sock);
+            continue;
+        }
+        printf("New client connected. Socket: %d\n", new_sock);
+    }
+}
+
+// Drain the socket until EAGAIN. Returns 1 once the peer has shut down
+// its side, or -1 on an error.
+static int epoll_read(struct reactor *r, int sock) {
+    char buf[RECV_BUF];
+    int rc;
+
+    // Replies to everything read now leave together (-p throughput).
+    tune_cork(sock, profile, 1);
+    while (1) {
+        int bytes = recv(sock, buf, sizeof(buf), 0);
+        STAT_ADD(r, syscalls, 1);
+        if (bytes > 0) {
+            if (client_input(r, sock, buf, bytes) < 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes == 0)
+            rc = 1;
+        else
+            rc = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        break;
+    }
+    tune_cork(sock, profile, 0);
+    tune_after_read(sock, profile);
+    return rc;
+}
+
+static void reactor_init(struct reactor *r, int id, int listen_sock, int local_sock,
+                         enum backend backend) {
+    struct epoll_event ev;
+
+    r->id = id;
+    r->backend = backend;
+    r->listen_sock = listen_sock;
+    r->local_sock = local_sock;
+    client_set_init(r);
+
+    if (pipe2(r->mbox, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2 failed");
+        exit(1);
+    }
+    set_nonblocking(listen_sock);
+
+    // The io_uring backend arms its own operations in uring_loop().
+    if (backend == BACKEND_URING)
+        return;
+
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_sock;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = local_sock;
+    if (local_sock >= 0 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, local_sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = r->mbox[0];
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->mbox[0], &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    // STDIN stays level-triggered: one line per wakeup is fine. epoll
+    // refuses a regular file or /dev/null with EPERM; the server then
+    // simply runs without operator input.
+    if (id == 0) {
+        ev.events = EPOLLIN;
+        ev.data.fd = STDIN_FILENO;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0 && errno != EPERM)
+            perror("epoll_ctl stdin");
+    }
+}
+
+static void *epoll_loop(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int lingering = 0;
+
+    affinity_enter(placement_cpu(&placement, r->id));
+
+    while (1) {
+        // Deadlines only need the loop to wake once a tick, and only
+        // while one is armed: without -I/-K/-D that is just a half-closed
+        // peer still being flushed.
+        int timeout = r->timers.count ? TIMER_TICK_MS : -1;
+        // Closed connections still waiting on zero-copy completions need
+        // the loop to wake now and then as well.
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS,
+                           lingering && (timeout < 0 || timeout > OUTQ_LINGER_MS)
+                               ? OUTQ_LINGER_MS : timeout);
+        STAT_ADD(r, syscalls, 1);
+        r->now = timer_now();
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait error");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == r->listen_sock || fd == r->local_sock) {
+                epoll_accept(r, fd);
+            } else if (fd == r->mbox[0]) {
+                reactor_mailbox(r);
+            } else if (fd == STDIN_FILENO && r->id == 0) {
+                if (!read_stdin_lines(reactor_deliver, r))
+                    epoll_ctl(r->epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            } else if (conn_active(r, fd)) {
+                struct conn *c = conn_of(fd);
+                uint32_t e = events[i].events;
+                int rc = 0;
+
+                // Zero-copy completions also raise EPOLLERR.
+                if ((e & EPOLLERR) && c->tx && zerocopy_min && outq_reap(c->tx, fd) == 0)
+                    e &= ~EPOLLERR;
+                if (!(e & (EPOLLERR | EPOLLHUP)) && !c->closing && (e & (EPOLLIN | EPOLLRDHUP)))
+                    rc = epoll_read(r, fd);
+                if ((e & (EPOLLERR | EPOLLHUP)) || rc < 0) {
+                    epoll_close(r, fd);
+                    continue;
                 }
+                // A peer that has shut down its side still gets what is
+                // queued for it, within the write deadline.
+                if (rc > 0) {
+                    c->closing = 1;
+                    timer_add(&r->timers, &c->clock.timer,
+                              r->now + (timeouts.write ? timeouts.write : DRAIN_TICKS));
+                }
+                if ((e & EPOLLOUT) && c->tx && !outq_empty(c->tx)) {
+                    rc = outq_flush(c->tx, fd, &limits);
+                    STAT_ADD(r, syscalls, 1);
+                    if (rc < 0) {
+                        epoll_close(r, fd);
+                        continue;
+                    }
+                    c->clock.tx_since = rc ? 0 : r->now;    // progress
+                }
+                if (c->closing && (!c->tx || outq_empty(c->tx)))
+                    epoll_close(r, fd);
+            }
+        }
+
+        timer_wheel_advance(&r->timers, r->now, conn_expired, r);
+        lingering = outq_linger_reap();
+    }
+    return NULL;
+}
+
+/*-------------------------------------------------
+ * io_uring backend (multishot accept/recv, provided buffer ring)
+ *-------------------------------------------------*/
+
+// user_data carries the operation in the low byte, the fd in the next
+// 24 bits and, for a connection's operations, the fd's generation in the
+// top 32: a completion that outlives its connection, such as a POLLOUT,
+// is then dropped rather than taken for a new connection on the fd.
+enum { OP_ACCEPT = 1, OP_RECV, OP_POLL_STDIN, OP_POLL_MBOX, OP_POLL_OUT, OP_SEND, OP_TICK };
+#define UDATA(op, fd) (((__u64)(fd) << 8) | (op))
+#define UDATA_FD_MAX  0xffffff
+#define UDATA_CONN(op, fd) (UDATA(op, fd) | \
+    (__u64)__atomic_load_n(&conn_table[fd].gen, __ATOMIC_RELAXED) << 32)
+
+// The listeners, STDIN, the mailbox and the tick keep the reactor going;
+// if one of them can't be armed, the reactor can't go on.
+static struct io_uring_sqe *uring_must_get_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe) {
+        perror("io_uring submission queue full");
+        exit(1);
+    }
+    return sqe;
+}
+
+static void uring_arm_accept(struct uring *u, int listen_sock) {
+    struct io_uring_sqe *sqe = uring_must_get_sqe(u);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = UDATA(OP_ACCEPT, listen_sock);
+}
+
+// One multishot recv per connection; the kernel picks a buffer from the
+// provided ring for every completion, so nothing is pinned while idle.
+// Returns -1 if no SQE was to be had.
+static int uring_arm_recv(struct uring *u, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UDATA_CONN(OP_RECV, fd);
+    return 0;
+}
+
+// STDIN and the mailbox are serviced by the same synchronous helpers as
+// the epoll backend; a one-shot poll re-armed after each use keeps them
+// level-triggered.
+static void uring_arm_poll(struct uring *u, int fd, int op) {
+    struct io_uring_sqe *sqe = uring_must_get_sqe(u);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UDATA(op, fd);
+}
+
+// A pure timeout that completes once a tick to drive the timer wheel.
+static struct __kernel_timespec tick_ts = { 0, TIMER_TICK_MS * 1000000LL };
+
+static void uring_arm_tick(struct uring *u) {
+    struct io_uring_sqe *sqe = uring_must_get_sqe(u);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&tick_ts;
+    sqe->len = 1;
+    sqe->user_data = UDATA(OP_TICK, 0);
+}
+
+// The ring of the reactor running on this thread; used to queue POLLOUT
+// requests from the shared send path.
+static __thread struct uring *cur_ring;
+
+static void uring_arm_pollout(struct reactor *r, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (conn_of(fd)->wait_out)
+        return;
+    // Without the poll the queue would never drain: give up on the client.
+    if (!(sqe = uring_get_sqe(cur_ring))) {
+        uring_request_close(r, fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = UDATA_CONN(OP_POLL_OUT, fd);
+    conn_of(fd)->wait_out = 1;
+}
+
+// Never close a socket that still has a multishot recv in flight: a late
+// completion could then be taken for a new connection reusing the fd.
+// Shutting it down ends the recv, and its final CQE does the close.
+static void uring_request_close(struct reactor *r, int sock) {
+    timer_del(&r->timers, &conn_of(sock)->clock.timer);
+    conn_of(sock)->closing = 1;
+    shutdown(sock, SHUT_RDWR);
+}
+
+// Send the head of the output queue as an SQE. It is submitted with the
+// next io_uring_enter together with every other pending operation, so a
+// broadcast to thousands of clients costs one system call, not one each.
+static void uring_kick_send(struct reactor *r, int fd) {
+    struct conn *c = conn_of(fd);
+    struct io_uring_sqe *sqe;
+    const char *data;
+    size_t len;
+
+    if (c->send_inflight || c->wait_out || c->closing || !c->tx || outq_empty(c->tx))
+        return;
+    if (outq_head_file(c->tx)) {
+        // File ranges go out with sendfile() on the non-blocking socket;
+        // whatever it will not take now waits for POLLOUT.
+        int rc = outq_flush(c->tx, fd, &limits);
+        STAT_ADD(r, syscalls, 1);
+        if (rc < 0)
+            uring_request_close(r, fd);
+        else if (rc == 0)
+            uring_arm_pollout(r, fd);
+        c->clock.tx_since = rc > 0 ? 0 : r->now;
+        return;
+    }
+    data = outq_front(c->tx, &len);
+    if (!(sqe = uring_get_sqe(cur_ring))) {
+        uring_request_close(r, fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    if (zerocopy_min && len >= zerocopy_min && !c->zc_copied &&
+        outq_zc_reserve(c->tx, 1) == 0) {
+        // The kernel pins the buffer instead of copying it and posts a
+        // second, notification CQE once it is done with it.
+        sqe->opcode = IORING_OP_SEND_ZC;
+        sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    }
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UDATA_CONN(OP_SEND, fd);
+    c->send_inflight = 1;
+}
+
+// The kernel is done with the buffers of the oldest SEND_ZC.
+static void uring_on_notif(struct reactor *r, int fd, int res) {
+    struct conn *c = conn_of(fd);
+
+    c->zc_inflight--;
+    outq_zc_done(c->tx, c->tx->zc_acked);
+    // e.g. over loopback: pinning pages is then pure overhead.
+    if (res & IORING_NOTIF_USAGE_ZC_COPIED)
+        c->zc_copied = 1;
+    if (c->closing == 2 && !c->send_inflight && !c->zc_inflight)
+        client_release(r, fd);
+}
+
+static void uring_on_send(struct reactor *r, int fd, int res, unsigned flags) {
+    struct conn *c = conn_of(fd);
+
+    if (flags & IORING_CQE_F_NOTIF) {
+        uring_on_notif(r, fd, res);
+        return;
+    }
+    c->send_inflight = 0;
+    if (flags & IORING_CQE_F_MORE) {
+        // A SEND_ZC: what it wrote stays in use until the notification.
+        c->zc_inflight++;
+        outq_zc_hold(c->tx, res > 0 ? res : 0);
+    }
+    if (c->closing == 2) {
+        if (!c->zc_inflight)
+            client_release(r, fd);
+        return;
+    }
+    if (c->slot < 0 || c->closing)
+        return;
+    if (res == -EAGAIN) {
+        uring_arm_pollout(r, fd);
+    } else if (res < 0) {
+        uring_request_close(r, fd);
+    } else {
+        outq_consume(c->tx, res, &limits);
+        c->clock.tx_since = outq_empty(c->tx) ? 0 : r->now;    // progress
+        uring_kick_send(r, fd);
+    }
+}
+
+static void uring_on_pollout(struct reactor *r, int fd, int res) {
+    struct conn *c = conn_of(fd);
+    int rc;
+
+    // The poll can outlive a connection that was closed meanwhile.
+    if (!conn_active(r, fd))
+        return;
+    c->wait_out = 0;
+    if (c->closing || c->send_inflight)
+        return;
+    STAT_ADD(r, syscalls, 1);
+    rc = res < 0 ? -1 : c->tx ? outq_flush(c->tx, fd, &limits) : 1;
+    if (rc < 0) {
+        uring_request_close(r, fd);
+        return;
+    }
+    c->clock.tx_since = rc ? 0 : r->now;
+    if (rc == 0)
+        uring_arm_pollout(r, fd);
+}
+
+static void uring_close(struct reactor *r, int sock) {
+    printf("[Client %d] Disconnected.\n", sock);
+    client_remove(&r->cs, sock);
+    // The kernel may still be reading a queued buffer for a SEND; keep the
+    // socket and its queue until that completion arrives.
+    if (conn_of(sock)->send_inflight || conn_of(sock)->zc_inflight) {
+        conn_of(sock)->closing = 2;
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
+    client_release(r, sock);
+}
+
+static void uring_on_accept(struct reactor *r, struct uring *u, int res) {
+    if (res < 0) {
+        if (res != -EAGAIN && res != -ECONNABORTED && res != -EINTR) {
+            errno = -res;
+            perror("accept failed");
+        }
+        return;
+    }
+    if (res >= max_fds || res > UDATA_FD_MAX || client_open(r, res) < 0) {
+        printf("Too many clients. Closing socket %d\n", res);
+        close(res);
+        return;
+    }
+    printf("New client connected. Socket: %d\n", res);
+    // No recv in flight yet, so it can be closed right away.
+    if (uring_arm_recv(u, res) < 0)
+        uring_close(r, res);
+}
+
+static void uring_on_recv(struct reactor *r, struct uring *u, struct uring_bufs *bufs,
+                          int fd, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int bad = res > 0 && client_input(r, fd, uring_buf(bufs, bid), res) < 0;
+
+        uring_recycle_buf(bufs, bid);
+        if (res > 0 && !bad)
+            tune_after_read(fd, profile);
+        // Marks the connection closing; if this was the last CQE of the
+        // recv, it is closed below rather than left without one.
+        if (bad)
+            uring_request_close(r, fd);
+    }
+
+    if (flags & IORING_CQE_F_MORE)
+        return;
+
+    // The multishot recv has terminated. Running out of provided buffers
+    // is transient; anything else means the connection is finished.
+    if ((res > 0 || res == -ENOBUFS) && !conn_of(fd)->closing &&
+        uring_arm_recv(u, fd) == 0)
+        return;
+    if (conn_of(fd)->slot >= 0)
+        uring_close(r, fd);
+}
+
+static void *uring_loop(void *arg) {
+    struct reactor *r = arg;
+    struct uring u;
+    struct uring_bufs bufs;
+    struct io_uring_cqe *cqe;
+    unsigned long enters = 0;
+    int stdin_open = (r->id == 0);
+
+    // Pinned first, so the rings and buffers land on this CPU's node.
+    affinity_enter(placement_cpu(&placement, r->id));
+    if (uring_init(&u, URING_ENTRIES) < 0) {
+        perror("io_uring_setup failed");
+        exit(1);
+    }
+    cur_ring = &u;
+    if (uring_setup_bufs(&u, &bufs, URING_BGID, URING_BUFS, URING_BUF_SIZE) < 0) {
+        perror("io_uring buffer ring registration failed");
+        exit(1);
+    }
+
+    uring_arm_accept(&u, r->listen_sock);
+    if (r->local_sock >= 0)
+        uring_arm_accept(&u, r->local_sock);
+    uring_arm_poll(&u, r->mbox[0], OP_POLL_MBOX);
+    if (stdin_open)
+        uring_arm_poll(&u, STDIN_FILENO, OP_POLL_STDIN);
+    if (timeouts_enabled(&timeouts))
+        uring_arm_tick(&u);
+
+    while (1) {
+        // All SQEs queued while handling the previous batch go to the
+        // kernel in the same call that waits for the next completions.
+        if (uring_submit_and_wait(&u, 1) < 0 && errno != EBUSY)
+            perror("io_uring_enter error");
+        // Including the calls uring_get_sqe() made to empty a full ring.
+        STAT_ADD(r, syscalls, u.enters - enters);
+        enters = u.enters;
+        r->now = timer_now();
+
+        while ((cqe = uring_peek_cqe(&u)) != NULL) {
+            int op = cqe->user_data & 0xff;
+            int fd = (cqe->user_data >> 8) & UDATA_FD_MAX;
+            unsigned gen = cqe->user_data >> 32;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(&u);
+            if ((op == OP_RECV || op == OP_POLL_OUT || op == OP_SEND) &&
+                gen != __atomic_load_n(&conn_table[fd].gen, __ATOMIC_RELAXED)) {
+                if (flags & IORING_CQE_F_BUFFER)
+                    uring_recycle_buf(&bufs, flags >> IORING_CQE_BUFFER_SHIFT);
+                continue;   // for an earlier connection on this fd
+            }
+
+            switch (op) {
+            case OP_ACCEPT:
+                uring_on_accept(r, &u, res);
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_arm_accept(&u, fd);
+                break;
+            case OP_RECV:
+                uring_on_recv(r, &u, &bufs, fd, res, flags);
+                break;
+            case OP_POLL_OUT:
+                uring_on_pollout(r, fd, res);
+                break;
+            case OP_SEND:
+                uring_on_send(r, fd, res, flags);
+                break;
+            case OP_POLL_MBOX:
+                reactor_mailbox(r);
+                uring_arm_poll(&u, r->mbox[0], OP_POLL_MBOX);
+                break;
+            case OP_POLL_STDIN:
+                if (res < 0 || !read_stdin_lines(reactor_deliver, r))
+                    stdin_open = 0;
+                if (stdin_open)
+                    uring_arm_poll(&u, STDIN_FILENO, OP_POLL_STDIN);
+                break;
+            case OP_TICK:
+                uring_arm_tick(&u);
+                break;
             }
         }
+
+        timer_wheel_advance(&r->timers, r->now, conn_expired, r);
+    }
+    return NULL;
+}
+
+/*-------------------------------------------------
+ * Startup and statistics
+ *-------------------------------------------------*/
+
+// Once a second, report message rate and system calls per message summed
+// over all reactors, so the backends can be compared under the same load.
+static void *stats_loop(void *arg) {
+    unsigned long last_msgs = 0, last_calls = 0;
+
+    (void)arg;
+    while (1) {
+        unsigned long msgs = 0, calls = 0;
+
+        sleep(1);
+        for (int i = 0; i < num_reactors; i++) {
+            msgs += __atomic_load_n(&reactors[i].metrics.msgs_in, __ATOMIC_RELAXED);
+            calls += __atomic_load_n(&reactors[i].syscalls, __ATOMIC_RELAXED);
+        }
+        if (msgs != last_msgs)
+            printf("[stats] %lu msgs/sec, %.2f syscalls/msg\n", msgs - last_msgs,
+                   (double)(calls - last_calls) / (msgs - last_msgs));
+        last_msgs = msgs;
+        last_calls = calls;
+    }
+    return NULL;
+}
+
+// Operator messages waiting in each reactor's mailbox pipe.
+static void mailbox_depths(FILE *out) {
+    fprintf(out, "# HELP " METRICS_PREFIX "mailbox_depth Messages waiting in a reactor's mailbox.\n"
+                 "# TYPE " METRICS_PREFIX "mailbox_depth gauge\n");
+    for (int i = 0; i < num_reactors; i++) {
+        int bytes = 0;
+
+        ioctl(reactors[i].mbox[0], FIONREAD, &bytes);
+        fprintf(out, METRICS_PREFIX "mailbox_depth{reactor=\"%d\"} %zu\n", i,
+                bytes / sizeof(struct mail));
+    }
+}
+
+// Start serving -M scrapes once the reactors exist.
+static void metrics_start(int mailboxes) {
+    if (!metrics_path)
+        return;
+    for (int i = 0; i < num_reactors; i++)
+        metrics_register(&reactors[i].metrics);
+    if (metrics_serve(metrics_path, mailboxes ? mailbox_depths : NULL) < 0) {
+        perror("metrics socket failed");
+        exit(1);
+    }
+    printf("Serving metrics on %s\n", metrics_path);
+}
+
+static void run_reactors(int listen_sock, int local_sock, int workers, enum backend backend) {
+    void *(*loop)(void *) = backend == BACKEND_URING ? uring_loop : epoll_loop;
+
+    num_reactors = workers;
+    for (int i = 0; i < workers; i++) {
+        int cpu = placement_cpu(&placement, i);
+
+        // Reactor 0 reuses the listeners opened by main(); the others bind
+        // their own SO_REUSEPORT sockets to the TCP port. What reactor_init
+        // allocates is placed on the node of the CPU the reactor will run on.
+        mem_prefer_node(cpu >= 0 ? cpu_node(cpu) : -1);
+        reactor_init(&reactors[i], i, i == 0 ? listen_sock : make_listener(1),
+                     i == 0 ? local_sock : -1, backend);
     }
+    mem_prefer_node(-1);
+    if (placement.count)
+        printf("Reactors pinned to %d CPU%s, memory on their nodes\n",
+               placement.count, placement.count > 1 ? "s" : "");
+    if (placement.count && steer_reuseport(listen_sock, &placement, workers) < 0)
+        perror("reuseport steering failed");
+    if (steer_dev)
+        steer_rx(steer_dev, &placement);
+
+    printf("Event-based Server (%s, %d reactor%s) listening on port %d, up to %d descriptors...\n",
+           backend == BACKEND_URING ? "io_uring" : "epoll", workers, workers > 1 ? "s" : "",
+           SERVER_PORT, max_fds);
+    metrics_start(1);
+
+    for (int i = 1; i < workers; i++) {
+        if (pthread_create(&reactors[i].tid, NULL, loop, &reactors[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    loop(&reactors[0]);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-m select|epoll|uring] [-w reactors] [-s] [-e] [-q]\n"
+                    "       [-H high-watermark] [-L low-watermark] [-P drop|close]\n"
+                    "       [-I idle-secs] [-K keepalive-secs] [-D write-deadline-secs]\n"
+                    "       [-z zerocopy-min-bytes] [-p default|latency|throughput]\n"
+                    "       [-b backlog] [-A defer-accept-secs] [-F fastopen-queue]\n"
+                    "       [-M metrics-socket-path] [-U local-socket-path]\n"
+                    "       [-c cpu-list|auto] [-n steer-netdev]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    enum backend backend = BACKEND_EPOLL;
+    int listen_sock, local_sock = -1, opt, workers = 1, stats = 0;
+    pthread_t stats_tid;
+
+    while ((opt = getopt(argc, argv, "m:w:seqH:L:P:I:K:D:z:p:b:A:F:M:U:c:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "select") == 0)
+                backend = BACKEND_SELECT;
+            else if (strcmp(optarg, "epoll") == 0)
+                backend = BACKEND_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                backend = BACKEND_URING;
+            else
+                usage(argv[0]);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1 || workers > MAX_REACTORS)
+                usage(argv[0]);
+            break;
+        case 's':
+            stats = 1;
+            break;
+        case 'e':
+            echo_mode = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'H':
+            limits.high = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            limits.low = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            timeouts.idle = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'K':
+            timeouts.keepalive = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'D':
+            timeouts.write = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'z':
+            zerocopy_min = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            if (tune_parse(optarg, &profile) < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            listen_opts.backlog = atoi(optarg);
+            break;
+        case 'A':
+            listen_opts.defer_secs = atoi(optarg);
+            break;
+        case 'F':
+            listen_opts.fastopen = atoi(optarg);
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        case 'c':
+            if (placement_parse(&placement, optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            steer_dev = optarg;
+            break;
+        case 'P':
+            if (strcmp(optarg, "drop") == 0)
+                limits.policy = OUTQ_DROP;
+            else if (strcmp(optarg, "close") == 0)
+                limits.policy = OUTQ_CLOSE;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // select has a single loop; multiple reactors, connection deadlines,
+    // zero-copy sends, local transports and placement only apply to epoll
+    // and io_uring.
+    if (backend == BACKEND_SELECT) {
+        workers = 1;
+        zerocopy_min = 0;
+        memset(&timeouts, 0, sizeof(timeouts));
+        local_path = "";
+        placement.count = 0;
+        steer_dev = NULL;
+    }
+    if (steer_dev && !placement.count) {
+        fprintf(stderr, "-n needs -c to say where to steer to\n");
+        usage(argv[0]);
+    }
+    listen_sock = make_listener(workers > 1);
+    if (!local_path)
+        local_path = local_default_path();
+    if (*local_path) {
+        if ((local_sock = local_listen(local_path, &listen_opts)) < 0 ||
+            shm_serve(local_path, shm_message) < 0) {
+            perror("local listener failed");
+            exit(1);
+        }
+        printf("Local clients: %s (UNIX socket), %s" SHM_SUFFIX " (shared memory)\n",
+               local_path, local_path);
+    }
+
+    max_fds = raise_fd_limit();
+    if (limits.low > limits.high)
+        limits.low = limits.high;
+    conn_table = calloc(max_fds, sizeof(struct conn_entry));
+    if (!conn_table) {
+        perror("malloc failed");
+        exit(1);
+    }
+    if (!(ping = msgbuf_frame("", 0))) {
+        perror("malloc failed");
+        exit(1);
+    }
+
+    if (stats && pthread_create(&stats_tid, NULL, stats_loop, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+
+    if (backend == BACKEND_SELECT)
+        run_select(listen_sock);
+    else
+        run_reactors(listen_sock, local_sock, workers, backend);
 
     close(listen_sock);
     return 0;
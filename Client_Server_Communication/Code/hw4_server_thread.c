@@ -1,87 +1,947 @@
 // server.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <assert.h>
+#include "affinity.h"
+#include "framing.h"
+#include "local.h"
+#include "metrics.h"
+#include "outq.h"
+#include "timer.h"
+#include "tune.h"
 
 #define SERVER_PORT  5432
-#define MAX_PENDING  5
-#define MAX_LINE     256
+#define MAX_PENDING  SOMAXCONN  // load tests open connections in bursts
+#define MAX_LINE     256               // operator lines typed on STDIN
+#define RECV_BUF     65536
+#define MAX_WORKERS  256
+#define MAX_EVENTS   256
+#define QUEUE_SIZE   4096              // accepted connections per worker queue (power of 2)
+#define WORKER_STACK (256 * 1024)      // workers never recurse; the 8 MB default is waste
+#define STEAL_BATCH  32                // connections taken from a victim per steal
+#define LINE_SLOTS   16                // operator lines queued per connection (power of 2)
+#define NOTIFY_SIZE  4096              // connections with pending lines per worker (power of 2)
+#define FDS_INITIAL  64                // a worker's fds[] to start with; doubled as it fills
+#define DRAIN_TICKS  (10000 / TIMER_TICK_MS)  // time a half-closed peer gets to take
+                                           // its queued output, without -D
 
-// This function handles communication with a single client
-void event_loop(int client_sock) {
-    fd_set readfds;
-    struct timeval tv;
-    int max_fd = STDIN_FILENO;
-    int activity;
-    char buf[MAX_LINE];
+// Bounded lock-free MPMC queue of accepted sockets (Vyukov). The acceptor
+// is the only producer; the owning worker and thieves are consumers.
+struct conn_cell {
+    unsigned long seq;
+    int fd;
+};
 
-    if (client_sock > max_fd) {
-        max_fd = client_sock;
+struct conn_queue {
+    struct conn_cell *cells;
+    unsigned long mask;
+    char pad0[64];
+    unsigned long enqueue_pos;
+    char pad1[64];
+    unsigned long dequeue_pos;
+    char pad2[64];
+};
+
+// Single-producer/single-consumer ring of fixed-size records. The STDIN
+// dispatcher is always the producer; the owning worker is the consumer.
+struct spsc {
+    char *buf;
+    unsigned esize;
+    unsigned long mask;
+    char pad0[64];
+    unsigned long head;     // consumer
+    char pad1[64];
+    unsigned long tail;     // producer
+    char pad2[64];
+};
+
+// An operator line queued for a connection, tagged with the generation
+// of the connection it was meant for.
+struct op_line {
+    unsigned gen;
+    char text[MAX_LINE];
+};
+
+// Per-descriptor state shared between the dispatcher and the workers.
+// Slots are indexed by fd and never freed, so the dispatcher can always
+// dereference one safely even while its connection is being closed.
+// All zeroes is an unowned slot, so the table's pages are only touched
+// once their descriptors are used.
+struct conn_slot {
+    int owner;              // worker id + 1, or 0 while unowned
+    int slot;               // owner only: index in the owner's fds[]
+    int pending;            // id + 1 of the worker told about lines, or 0
+    unsigned gen;           // bumped as each connection on the fd is adopted
+    int draining;           // owner only: the peer shut down its side; closes once tx empties
+    struct spsc *lines;     // operator lines, allocated on first use
+    struct frame_parser rx; // owner only
+    struct outq tx;         // owner only
+    struct conn_timer clock;    // owner only; armed on the owner's wheel
+};
+
+// A worker multiplexes every connection it owns on its own epoll set, so
+// memory stays at a fixed number of small stacks however many clients
+// connect. New connections arrive through its queue and eventfd.
+struct worker {
+    int id;
+    int cpu;            // pinned CPU (-c), or -1
+    int node;           // NUMA node of cpu
+    int epfd;
+    int wake_fd;
+    int *fds;           // connections owned by this worker (dense), grown as needed
+    int count, cap;
+    struct conn_queue queue;
+    struct spsc notify;     // fds with operator lines waiting
+    struct timer_wheel timers;  // idle, keepalive and write deadlines
+    uint64_t now;           // tick, sampled once per loop iteration
+    struct metrics metrics; // written by this worker only; summed by -M
+    pthread_t tid;
+};
+
+static struct worker workers[MAX_WORKERS];
+static int num_workers;
+static struct conn_slot *conns;
+static int max_fds;
+static int newest_client = -1;
+
+// Output queue watermarks and slow-consumer policy (-H, -L, -P).
+static struct outq_limits limits = { 4 << 20, 1 << 20, OUTQ_DROP };
+
+// Writes of at least this many bytes are sent zero-copy (-z); 0 = never.
+static size_t zerocopy_min;
+
+// UNIX socket serving metrics scrapes (-M); NULL = not served, and
+// message handling is then not timed.
+static const char *metrics_path;
+
+// Socket tuning profile (-p), applied to the listener.
+static enum tune_profile profile;
+
+// CPUs the workers are pinned to (-c), and the network device whose
+// interrupts and RPS are steered onto them (-n); NULL = leave it alone.
+static struct placement placement;
+static const char *steer_dev;
+
+// With -c: the worker pinned to each CPU, or else one on the CPU's node,
+// so a connection can be handed to the worker where its packets arrive.
+static short cpu_worker[AFFINITY_MAX_CPUS];
+
+// Path of the UNIX-domain listener for local clients (-U); its
+// shared-memory handshake socket is next to it. NULL = the per-user
+// local_default_path(), empty = TCP only.
+static const char *local_path;
+
+// Accept queue depth and optional listener features (-b, -A, -F).
+static struct listen_opts listen_opts = { MAX_PENDING, 0, 0 };
+
+// Load-test switches: echo every frame back (-e), don't print it (-q).
+static int echo_mode;
+static int quiet;
+
+// Connection deadlines (-I, -K, -D) and the keepalive ping: an empty
+// frame, shared by every connection and never freed.
+static struct timeouts timeouts;
+static struct msgbuf *ping;
+
+static void queue_init(struct conn_queue *q, unsigned long size) {
+    q->cells = malloc(sizeof(struct conn_cell) * size);
+    if (!q->cells) {
+        perror("malloc failed");
+        exit(1);
     }
+    for (unsigned long i = 0; i < size; i++)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+}
+
+static int queue_push(struct conn_queue *q, int fd) {
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    struct conn_cell *cell;
 
     while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-        FD_SET(client_sock, &readfds);
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;      // full
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->fd = fd;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-        tv.tv_sec = 30;
-        tv.tv_usec = 0;
+static int queue_pop(struct conn_queue *q) {
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    struct conn_cell *cell;
+    int fd;
 
-        activity = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+    while (1) {
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return -1;      // empty
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    fd = cell->fd;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return fd;
+}
 
-        if (activity < 0) {
-            perror("select");
-            break;
-        } else if (activity == 0) {
-            printf("[Client %d] No activity for 30 seconds.\n", client_sock);
+static unsigned long queue_depth(struct conn_queue *q) {
+    return __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED)
+         - __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+}
+
+static void spsc_init(struct spsc *q, unsigned long size, unsigned esize) {
+    q->buf = malloc(size * esize);
+    if (!q->buf) {
+        perror("malloc failed");
+        exit(1);
+    }
+    q->esize = esize;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+}
+
+static int spsc_push(struct spsc *q, const void *rec) {
+    unsigned long tail = q->tail;
+
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask)
+        return -1;      // full
+    memcpy(q->buf + (tail & q->mask) * q->esize, rec, q->esize);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int spsc_pop(struct spsc *q, void *rec) {
+    unsigned long head = q->head;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return -1;      // empty
+    memcpy(rec, q->buf + (head & q->mask) * q->esize, q->esize);
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void worker_wake(struct worker *w) {
+    uint64_t one = 1;
+    if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+static int owner_of(int fd) {
+    return __atomic_load_n(&conns[fd].owner, __ATOMIC_ACQUIRE) - 1;
+}
+
+// Take ownership of an accepted socket.
+static void worker_adopt(struct worker *w, int sock) {
+    struct epoll_event ev;
+
+    if (w->count == w->cap) {
+        int cap = w->cap ? w->cap * 2 : FDS_INITIAL;
+        int *grown = realloc(w->fds, sizeof(int) * cap);
+
+        if (!grown) {
+            perror("malloc failed");
+            close(sock);
+            return;
+        }
+        w->fds = grown;
+        w->cap = cap;
+    }
+    // Edge-triggered EPOLLOUT only fires once a full send buffer drains.
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = sock;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(sock);
+        return;
+    }
+    conns[sock].tx.totals = &w->metrics.out;
+    METRIC_ADD(&w->metrics, accepted, 1);
+    if (zerocopy_min)
+        outq_zerocopy(&conns[sock].tx, sock, zerocopy_min);
+
+    conns[sock].slot = w->count;
+    conns[sock].draining = 0;
+    w->fds[w->count++] = sock;
+    // Lines still queued for an earlier connection on this fd no longer
+    // match, and a line racing its drop may have set pending again.
+    __atomic_store_n(&conns[sock].gen, conns[sock].gen + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&conns[sock].pending, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&conns[sock].owner, w->id + 1, __ATOMIC_RELEASE);
+
+    conns[sock].clock.last_rx = w->now;
+    conns[sock].clock.last_tx = w->now;
+    conns[sock].clock.tx_since = 0;
+    if (timeouts_enabled(&timeouts))
+        timer_add(&w->timers, &conns[sock].clock.timer, w->now + 1);
+}
+
+static void worker_drop(struct worker *w, int sock) {
+    struct spsc *lines = __atomic_load_n(&conns[sock].lines, __ATOMIC_ACQUIRE);
+    struct op_line line;
+    int slot = conns[sock].slot;
+    int last = w->fds[--w->count];
+
+    printf("[Client %d] Disconnected.\n", sock);
+    w->fds[slot] = last;
+    conns[last].slot = slot;
+    __atomic_store_n(&conns[sock].owner, 0, __ATOMIC_RELEASE);
+    // Its undelivered lines go with it, so the next client on this fd
+    // neither gets them nor waits on a notification that never comes.
+    while (lines && spsc_pop(lines, &line) == 0)
+        ;
+    __atomic_store_n(&conns[sock].pending, 0, __ATOMIC_SEQ_CST);
+    timer_del(&w->timers, &conns[sock].clock.timer);
+    frame_parser_reset(&conns[sock].rx);
+    outq_clear(&conns[sock].tx, sock);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, sock, NULL);
+    METRIC_ADD(&w->metrics, closed, 1);
+    close(sock);
+}
+
+// Record output for fd; rc is what outq_send() or outq_flush() returned.
+// Output that stays queued starts the write deadline, pulling the timer
+// in if it is armed for later.
+static void conn_output(struct worker *w, int fd, int rc) {
+    struct conn_timer *ct = &conns[fd].clock;
+
+    ct->last_tx = w->now;
+    if (rc > 0) {
+        ct->tx_since = 0;
+    } else if (!ct->tx_since) {
+        ct->tx_since = w->now;
+        if (timeouts.write && (!timer_pending(&ct->timer) ||
+                               ct->timer.expires > w->now + timeouts.write))
+            timer_add(&w->timers, &ct->timer, w->now + timeouts.write);
+    }
+}
+
+// A connection's timer fired: close it if a deadline passed, ping it if
+// it has been quiet, and re-arm for whatever is due next.
+static void conn_expired(struct timer *t, void *ctx) {
+    struct worker *w = ctx;
+    struct conn_slot *c = timer_entry(t, struct conn_slot, clock.timer);
+    int fd = (int)(c - conns);
+    enum timer_action action;
+    uint64_t next;
+    int rc;
+
+    if (c->draining) {
+        printf("[Client %d] Output not taken after the peer closed, closing.\n", fd);
+        worker_drop(w, fd);
+        return;
+    }
+    action = conn_timer_check(&c->clock, &timeouts, w->now, &next);
+    if (action == TIMER_PING) {
+        if ((rc = outq_send(&c->tx, fd, ping, &limits)) < 0) {
+            worker_drop(w, fd);
+            return;
+        }
+        conn_output(w, fd, rc);
+        action = conn_timer_check(&c->clock, &timeouts, w->now, &next);
+    }
+
+    if (action == TIMER_IDLE || action == TIMER_WRITE) {
+        printf("[Client %d] %s, closing.\n", fd,
+               action == TIMER_IDLE ? "Idle timeout" : "Write deadline missed");
+        worker_drop(w, fd);
+    } else if (action == TIMER_REARM) {
+        timer_add(&w->timers, t, next);
+    }
+}
+
+// Send every operator line queued for connections this worker owns.
+// Clearing pending before draining means a line pushed after the drain
+// always produces a fresh notification. Only the owner reads a
+// connection's lines; a notification for one it no longer owns is stale,
+// and worker_drop() has already discarded what it was about. The pending
+// it left behind names this worker, so dispatch_line() still notifies
+// the fd's new owner.
+static void worker_deliver(struct worker *w) {
+    struct op_line line;
+    int fd;
+
+    while (spsc_pop(&w->notify, &fd) == 0) {
+        struct conn_slot *c = &conns[fd];
+
+        if (owner_of(fd) != w->id)
             continue;
+        __atomic_exchange_n(&c->pending, 0, __ATOMIC_SEQ_CST);
+        while (owner_of(fd) == w->id && spsc_pop(c->lines, &line) == 0) {
+            struct msgbuf *b;
+
+            if (line.gen != c->gen)
+                continue;   // meant for an earlier connection on this fd
+            if (!(b = msgbuf_frame(line.text, strlen(line.text)))) {
+                perror("malloc failed");
+                continue;
+            }
+            // Never blocks: what the socket will not take now is flushed
+            // on EPOLLOUT; a peer that falls behind is handled by -P.
+            int rc = outq_send(&c->tx, fd, b, &limits);
+            if (rc < 0) {
+                printf("[Client %d] Slow consumer or send error, closing.\n", fd);
+                worker_drop(w, fd);
+            } else {
+                conn_output(w, fd, rc);
+            }
+            msgbuf_unref(b);
         }
+    }
+}
+
+// Drain our own queue, then take a batch from the first other worker
+// whose queue is non-empty, so a worker stuck on a busy connection does
+// not hold up new clients that an idle worker could serve. Workers on
+// our own NUMA node are robbed first; other nodes only if they have none.
+static void worker_collect(struct worker *w) {
+    uint64_t n;
+    int fd;
+
+    if (read(w->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    worker_deliver(w);
+
+    while ((fd = queue_pop(&w->queue)) >= 0)
+        worker_adopt(w, fd);
 
-        if (FD_ISSET(client_sock, &readfds)) {
-            int bytes = recv(client_sock, buf, sizeof(buf), 0);
-            buf[MAX_LINE - 1] = '\0';
-            if (bytes <= 0) {
-                printf("[Client %d] Disconnected.\n", client_sock);
-                close(client_sock);
+    for (int remote = 0; remote < 2; remote++) {
+        for (int i = 1; i < num_workers; i++) {
+            struct worker *victim = &workers[(w->id + i) % num_workers];
+            int stolen = 0;
+
+            if ((victim->node != w->node) != remote)
+                continue;
+            while (stolen < STEAL_BATCH && (fd = queue_pop(&victim->queue)) >= 0) {
+                worker_adopt(w, fd);
+                stolen++;
+            }
+            if (stolen)
                 return;
+        }
+    }
+}
+
+// Called by the frame parser for every complete client message.
+static int on_message(void *ctx, const char *msg, size_t len) {
+    int client_sock = *(int *)ctx;
+    struct worker *w = &workers[owner_of(client_sock)];
+    uint64_t start = metrics_path ? metrics_now() : 0;
+    struct msgbuf *b;
+    int rc;
+
+    if (len == 0)
+        return 0;   // keepalive
+    METRIC_ADD(&w->metrics, msgs_in, 1);
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", client_sock, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", client_sock, MAX_LINE, msg, len);
+    }
+    if (!echo_mode)
+        return 0;
+
+    // Echo it back. A failed send is reported to client_read(), which
+    // closes the connection once the parser is done with its buffer.
+    b = msgbuf_frame(msg, len);
+    if (!b)
+        return 1;
+    rc = outq_send(&conns[client_sock].tx, client_sock, b, &limits);
+    msgbuf_unref(b);
+    if (rc >= 0)
+        conn_output(w, client_sock, rc);
+    if (metrics_path)
+        metric_observe(&w->metrics.handle_ns, metrics_now() - start);
+    return rc < 0;
+}
+
+// Called for every frame from a shared-memory client, on the thread that
+// serves that client's ring.
+static int shm_message(void *ctx, const char *msg, size_t len) {
+    struct shm_chan *ch = ctx;
+
+    if (len == 0)
+        return 0;   // keepalive
+    if (!quiet) {
+        if (len <= MAX_LINE)
+            printf("[Client %d]: %.*s\n", ch->sock, (int)len, msg);
+        else
+            printf("[Client %d]: %.*s... (%zu bytes)\n", ch->sock, MAX_LINE, msg, len);
+    }
+    return echo_mode ? shm_send_frame(ch, msg, len) < 0 : 0;
+}
+
+// Drain the socket until EAGAIN. Returns 1 once the peer has shut down
+// its side, or -1 on an error or a malformed frame.
+static int client_read(int client_sock) {
+    char buf[RECV_BUF];
+    int rc;
+
+    // Replies to everything read now leave together (-p throughput).
+    tune_cork(client_sock, profile, 1);
+    while (1) {
+        int bytes = recv(client_sock, buf, sizeof(buf), 0);
+        if (bytes > 0) {
+            METRIC_ADD(&workers[owner_of(client_sock)].metrics, bytes_in, bytes);
+            int fr = frame_feed(&conns[client_sock].rx, buf, bytes, on_message, &client_sock);
+            if (fr < 0)
+                printf("[Client %d] Bad frame: %s\n", client_sock, strerror(errno));
+            if (fr) {
+                rc = -1;
+                break;
             }
-            printf("[Client %d]: %s\n", client_sock, buf);
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes == 0)
+            rc = 1;
+        else
+            rc = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        break;
+    }
+    tune_cork(client_sock, profile, 0);
+    tune_after_read(client_sock, profile);
+    return rc;
+}
+
+// Route one operator line. "@<socket> text" picks the client; any other
+// line goes to the newest client. Only the owning worker touches the
+// socket: the line is queued on the connection and the owner is woken.
+static void dispatch_line(char *line) {
+    int fd = __atomic_load_n(&newest_client, __ATOMIC_RELAXED);
+    struct conn_slot *c;
+    struct worker *w;
+    struct op_line rec;
+    int owner;
+
+    if (line[0] == '@') {
+        char *text;
+        fd = (int)strtol(line + 1, &text, 10);
+        if (text == line + 1 || (*text != ' ' && *text != '\0')) {
+            printf("usage: @<socket> message\n");
+            return;
         }
+        memmove(line, text + (*text == ' '), strlen(text + (*text == ' ')) + 1);
+    }
+    if (fd < 0 || fd >= max_fds) {
+        printf("No client to send to.\n");
+        return;
+    }
+
+    c = &conns[fd];
+    owner = owner_of(fd);
+    if (owner < 0) {
+        printf("Client %d is not connected.\n", fd);
+        return;
+    }
+    w = &workers[owner];
+    rec.gen = __atomic_load_n(&c->gen, __ATOMIC_RELAXED);
+    snprintf(rec.text, sizeof(rec.text), "%s", line);
 
-        if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (fgets(buf, sizeof(buf), stdin) != NULL) {
-                buf[MAX_LINE - 1] = '\0';
-                if (send(client_sock, buf, strlen(buf) + 1, 0) < 0) {
-                    perror("send error");
-                    close(client_sock);
-                    return;
+    if (!c->lines) {
+        struct spsc *lines = malloc(sizeof(struct spsc));
+        if (!lines) {
+            perror("malloc failed");
+            return;
+        }
+        spsc_init(lines, LINE_SLOTS, sizeof(struct op_line));
+        __atomic_store_n(&c->lines, lines, __ATOMIC_RELEASE);
+    }
+    if (spsc_push(c->lines, &rec) < 0) {
+        printf("Client %d has too many pending lines; dropped.\n", fd);
+        return;
+    }
+
+    // pending records which worker was told. If the fd moved to another
+    // worker after an earlier notification, the new owner is told as well.
+    if (__atomic_exchange_n(&c->pending, owner + 1, __ATOMIC_SEQ_CST) != owner + 1) {
+        if (spsc_push(&w->notify, &fd) < 0) {
+            // Leave the line queued; the next one for this client retries.
+            __atomic_store_n(&c->pending, 0, __ATOMIC_SEQ_CST);
+            printf("Worker %d is saturated; client %d will get the line later.\n", owner, fd);
+            return;
+        }
+        worker_wake(w);
+    }
+}
+
+// The only reader of STDIN, so workers never wake for operator input
+// that is not addressed to one of their clients.
+static void *stdin_dispatcher(void *arg) {
+    char line[MAX_LINE];
+    char chunk[MAX_LINE];
+    int len = 0;
+    ssize_t n;
+
+    (void)arg;
+    printf("Type '@<socket> message' to pick a client; other lines go to the newest client.\n");
+    while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (chunk[i] != '\n') {
+                if (len < MAX_LINE - 1)
+                    line[len++] = chunk[i];
+                continue;
+            }
+            line[len] = '\0';
+            len = 0;
+            dispatch_line(line);
+        }
+    }
+    return NULL;
+}
+
+// This function handles communication with every client of one worker
+void* event_loop(void* arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int activity, lingering = 0;
+
+    affinity_enter(w->cpu);
+
+    while (1) {
+        // Deadlines only need the loop to wake once a tick, and only
+        // while one is armed: without -I/-K/-D that is just a half-closed
+        // peer still being flushed.
+        int timeout = w->timers.count ? TIMER_TICK_MS : -1;
+        // Closed connections still waiting on zero-copy completions need
+        // the loop to wake now and then as well.
+        activity = epoll_wait(w->epfd, events, MAX_EVENTS,
+                              lingering && (timeout < 0 || timeout > OUTQ_LINGER_MS)
+                                  ? OUTQ_LINGER_MS : timeout);
+        w->now = timer_now();
+
+        if (activity < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < activity; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == w->wake_fd) {
+                worker_collect(w);
+            } else if (owner_of(fd) == w->id) {
+                struct conn_slot *c = &conns[fd];
+                uint32_t e = events[i].events;
+                int rc = 0;
+
+                if (e & EPOLLIN)
+                    c->clock.last_rx = w->now;
+                // Zero-copy completions also raise EPOLLERR.
+                if ((e & EPOLLERR) && zerocopy_min && outq_reap(&c->tx, fd) == 0)
+                    e &= ~EPOLLERR;
+                if (!(e & (EPOLLERR | EPOLLHUP)) && !c->draining && (e & (EPOLLIN | EPOLLRDHUP)))
+                    rc = client_read(fd);
+                if ((e & (EPOLLERR | EPOLLHUP)) || rc < 0) {
+                    worker_drop(w, fd);
+                    continue;
+                }
+                // A peer that has shut down its side still gets what is
+                // queued for it, within the write deadline.
+                if (rc > 0) {
+                    c->draining = 1;
+                    timer_add(&w->timers, &c->clock.timer,
+                              w->now + (timeouts.write ? timeouts.write : DRAIN_TICKS));
+                }
+                if ((e & EPOLLOUT) && !outq_empty(&c->tx)) {
+                    if ((rc = outq_flush(&c->tx, fd, &limits)) < 0) {
+                        worker_drop(w, fd);
+                        continue;
+                    }
+                    c->clock.tx_since = rc ? 0 : w->now;  // progress
                 }
+                if (c->draining && outq_empty(&c->tx))
+                    worker_drop(w, fd);
             }
         }
+
+        timer_wheel_advance(&w->timers, w->now, conn_expired, w);
+        lingering = outq_linger_reap();
+    }
+    return NULL;
+}
+
+static void worker_start(struct worker *w, int id) {
+    struct epoll_event ev;
+    pthread_attr_t attr;
+
+    w->id = id;
+    w->cpu = placement_cpu(&placement, id);
+    w->node = w->cpu >= 0 ? cpu_node(w->cpu) : 0;
+    w->count = 0;
+    w->cap = 0;
+    w->fds = NULL;
+    // Everything allocated here is used by the worker, so put it on the
+    // worker's node. Connection state is touched first by the worker
+    // itself, which allocates from its own node once pinned.
+    mem_prefer_node(w->cpu >= 0 ? w->node : -1);
+    queue_init(&w->queue, QUEUE_SIZE);
+    spsc_init(&w->notify, NOTIFY_SIZE, sizeof(int));
+    w->now = timer_now();
+    timer_wheel_init(&w->timers, w->now);
+
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+    if ((w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = w->wake_fd;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+    mem_prefer_node(-1);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK);
+    if (pthread_create(&w->tid, &attr, event_loop, w) != 0) {
+        perror("pthread_create failed");
+        exit(1);
     }
+    pthread_attr_destroy(&attr);
+}
+
+// Hand a new connection to the next worker in turn. If that worker is
+// already behind, wake its neighbour as well so it can steal the backlog.
+// Both acceptors (TCP and UNIX-domain) call this.
+static void dispatch(int sock) {
+    static unsigned turn;
+    socklen_t len = sizeof(int);
+    int cpu;
+
+    // Keep the connection on the CPU (or at least the node) that its
+    // packets are processed on, unless that worker's queue is full.
+    if (placement.count && getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < AFFINITY_MAX_CPUS && cpu_worker[cpu] >= 0 &&
+        queue_push(&workers[cpu_worker[cpu]].queue, sock) == 0) {
+        worker_wake(&workers[cpu_worker[cpu]]);
+        return;
+    }
+
+    for (int tries = 0; tries < num_workers; tries++) {
+        int next = __atomic_fetch_add(&turn, 1, __ATOMIC_RELAXED) % num_workers;
+        struct worker *w = &workers[next];
+
+        if (queue_push(&w->queue, sock) == 0) {
+            worker_wake(w);
+            if (num_workers > 1 && queue_depth(&w->queue) > 1)
+                worker_wake(&workers[(next + 1) % num_workers]);
+            return;
+        }
+    }
+    printf("Too many pending clients. Closing socket %d\n", sock);
+    close(sock);
+}
+
+// Depth of each worker's hand-off queues: accepted sockets not yet
+// adopted, and connections with operator lines not yet delivered.
+static void queue_depths(FILE *out) {
+    fprintf(out, "# HELP " METRICS_PREFIX "handoff_queue_depth Accepted sockets waiting for a worker.\n"
+                 "# TYPE " METRICS_PREFIX "handoff_queue_depth gauge\n");
+    for (int i = 0; i < num_workers; i++)
+        fprintf(out, METRICS_PREFIX "handoff_queue_depth{worker=\"%d\"} %lu\n", i,
+                __atomic_load_n(&workers[i].queue.enqueue_pos, __ATOMIC_RELAXED) -
+                __atomic_load_n(&workers[i].queue.dequeue_pos, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP " METRICS_PREFIX "notify_queue_depth Connections with operator lines waiting.\n"
+                 "# TYPE " METRICS_PREFIX "notify_queue_depth gauge\n");
+    for (int i = 0; i < num_workers; i++)
+        fprintf(out, METRICS_PREFIX "notify_queue_depth{worker=\"%d\"} %lu\n", i,
+                __atomic_load_n(&workers[i].notify.tail, __ATOMIC_RELAXED) -
+                __atomic_load_n(&workers[i].notify.head, __ATOMIC_RELAXED));
+}
 
-    close(client_sock);
+// Fill cpu_worker[] once the workers know their CPUs and nodes.
+static void map_cpus(void) {
+    int ncpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+
+    for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+        int node = c < ncpus ? cpu_node(c) : -1;
+
+        cpu_worker[c] = -1;
+        for (int i = 0; i < num_workers; i++) {
+            if (workers[i].cpu == c) {
+                cpu_worker[c] = (short)i;
+                break;
+            }
+            if (cpu_worker[c] < 0 && workers[i].node == node)
+                cpu_worker[c] = (short)i;
+        }
+    }
 }
 
-// Thread function to handle each client
-void* client_thread(void* arg) {
-    int client_sock = *(int*)arg;
-    free(arg);
-    event_loop(client_sock);
+// Accept and hand each client to the worker pool, already non-blocking
+// so its worker can adopt it without another syscall.
+static void *acceptor(void *arg) {
+    int s = *(int *)arg;
+
+    while (1) {
+        int new_s = accept4(s, NULL, NULL, SOCK_NONBLOCK);
+        if (new_s < 0) {
+            perror("accept failed");
+            continue;
+        }
+        if (new_s >= max_fds) {
+            close(new_s);
+            continue;
+        }
+
+        printf("New client connected. Socket: %d\n", new_s);
+        __atomic_store_n(&newest_client, new_s, __ATOMIC_RELAXED);
+        dispatch(new_s);
+    }
     return NULL;
 }
 
-int main() {
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-w workers] [-e] [-q] [-H high-watermark]"
+                    " [-L low-watermark] [-P drop|close]\n"
+                    "       [-I idle-secs] [-K keepalive-secs] [-D write-deadline-secs]"
+                    " [-z zerocopy-min-bytes]\n"
+                    "       [-p default|latency|throughput]"
+                    " [-b backlog] [-A defer-accept-secs] [-F fastopen-queue]\n"
+                    "       [-M metrics-socket-path] [-U local-socket-path]\n"
+                    "       [-c cpu-list|auto] [-n steer-netdev]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
     struct sockaddr_in sin;
-    socklen_t addr_len = sizeof(sin);
-    int s;
+    struct rlimit rl;
+    pthread_t stdin_tid, local_tid;
+    int s, local_sock = -1, opt, on = 1;
+
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "w:eqH:L:P:I:K:D:z:p:b:A:F:M:U:c:n:")) != -1) {
+        switch (opt) {
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'e':
+            echo_mode = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'H':
+            limits.high = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            limits.low = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            timeouts.idle = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'K':
+            timeouts.keepalive = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'D':
+            timeouts.write = strtoul(optarg, NULL, 0) * 1000 / TIMER_TICK_MS;
+            break;
+        case 'z':
+            zerocopy_min = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            listen_opts.backlog = atoi(optarg);
+            break;
+        case 'A':
+            listen_opts.defer_secs = atoi(optarg);
+            break;
+        case 'F':
+            listen_opts.fastopen = atoi(optarg);
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'U':
+            local_path = optarg;
+            break;
+        case 'c':
+            if (placement_parse(&placement, optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            steer_dev = optarg;
+            break;
+        case 'p':
+            if (tune_parse(optarg, &profile) < 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            if (strcmp(optarg, "close") == 0)
+                limits.policy = OUTQ_CLOSE;
+            else if (strcmp(optarg, "drop") == 0)
+                limits.policy = OUTQ_DROP;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (steer_dev && !placement.count) {
+        fprintf(stderr, "-n needs -c to say where to steer to\n");
+        usage(argv[0]);
+    }
+    if (limits.low > limits.high)
+        limits.low = limits.high;
+    if (num_workers < 1)
+        num_workers = 1;
+    if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+
+    // Connections are bounded by descriptors, not threads
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    max_fds = (int)rl.rlim_cur;
+    conns = calloc(max_fds, sizeof(struct conn_slot));
+    if (!conns) {
+        perror("malloc failed");
+        exit(1);
+    }
+    if (!(ping = msgbuf_frame("", 0))) {
+        perror("malloc failed");
+        exit(1);
+    }
 
     // Build address data structure
     bzero((char *)&sin, sizeof(sin));
@@ -94,46 +954,59 @@ int main() {
         perror("socket failed");
         exit(1);
     }
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    tune_socket(s, profile);
 
     if ((bind(s, (struct sockaddr *)&sin, sizeof(sin))) < 0) {
         perror("bind failed");
         exit(1);
     }
 
-    if (listen(s, MAX_PENDING) < 0) {
+    if (tune_listen(s, &listen_opts) < 0) {
         perror("listen failed");
         exit(1);
     }
 
-    printf("Server listening on port %d...\n", SERVER_PORT);
-
-    // Accept and spawn threads for each client
-    while (1) {
-        int* new_s = malloc(sizeof(int));
-        if (!new_s) {
-            perror("malloc failed");
-            continue;
-        }
-
-        *new_s = accept(s, (struct sockaddr *)&sin, &addr_len);
-        if (*new_s < 0) {
-            perror("accept failed");
-            free(new_s);
-            continue;
-        }
+    for (int i = 0; i < num_workers; i++) {
+        if (metrics_path)
+            metrics_register(&workers[i].metrics);
+        worker_start(&workers[i], i);
+    }
+    if (placement.count) {
+        map_cpus();
+        printf("Workers pinned to %d CPU%s, memory on their nodes\n",
+               placement.count, placement.count > 1 ? "s" : "");
+    }
+    if (steer_dev)
+        steer_rx(steer_dev, &placement);
+    if (metrics_path && metrics_serve(metrics_path, queue_depths) < 0) {
+        perror("metrics socket failed");
+        exit(1);
+    }
 
-        printf("New client connected. Socket: %d\n", *new_s);
+    printf("Server listening on port %d with %d workers...\n", SERVER_PORT, num_workers);
+    if (pthread_create(&stdin_tid, NULL, stdin_dispatcher, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, new_s) != 0) {
-            perror("pthread_create failed");
-            close(*new_s);
-            free(new_s);
-        } else {
-            pthread_detach(tid);  // No need to join
+    // Local clients: UNIX-domain sockets join the worker pool like TCP
+    // ones, shared-memory clients get a thread each.
+    if (!local_path)
+        local_path = local_default_path();
+    if (*local_path) {
+        if ((local_sock = local_listen(local_path, &listen_opts)) < 0 ||
+            fcntl(local_sock, F_SETFL, 0) < 0 ||
+            shm_serve(local_path, shm_message) < 0 ||
+            pthread_create(&local_tid, NULL, acceptor, &local_sock) != 0) {
+            perror("local listener failed");
+            exit(1);
         }
+        printf("Local clients: %s (UNIX socket), %s" SHM_SUFFIX " (shared memory)\n",
+               local_path, local_path);
     }
 
+    acceptor(&s);
     close(s);
     return 0;
 }
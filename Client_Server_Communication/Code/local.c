@@ -0,0 +1,481 @@
+// local.c
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "local.h"
+
+#define SHM_SPIN     2000   // polls of an empty or full ring before sleeping,
+                            // when there is another CPU for the peer to run on
+#define SHM_CHECK_MS 100    // a sleeper wakes this often to check on its peer
+#define SHM_RECV     65536
+#define SHM_SEALS    (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)  // a region's size is fixed
+
+static frame_cb shm_cb;
+static int shm_sessions;    // live shm_session threads, at most SHM_MAX_SESSIONS
+static int shm_listen_fd = -1;
+static int shm_spin = -1;   // SHM_SPIN, or 0 on a single CPU; set on first wait
+
+static int local_addr(struct sockaddr_un *sun, const char *path, const char *suffix) {
+    if (strlen(path) + strlen(suffix) >= sizeof(sun->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    strcat(sun->sun_path, suffix);
+    return 0;
+}
+
+const char *local_default_path(void) {
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path) - sizeof(SHM_SUFFIX)];
+    const char *run = getenv("XDG_RUNTIME_DIR");
+
+    if (!path[0]) {
+        if (run && run[0] == '/' &&
+            snprintf(path, sizeof(path), "%s/" LOCAL_NAME, run) < (int)sizeof(path))
+            return path;
+        snprintf(path, sizeof(path), "/tmp/hw4-%u/" LOCAL_NAME, (unsigned)geteuid());
+    }
+    return path;
+}
+
+// Check that nobody else can put a file at path, or has: its directory
+// must belong to us or root and, unless sticky, be writable only by its
+// owner; a file already there must be a socket of ours. Returns 1 if
+// such a socket exists, 0 if nothing does, or -1 with errno EPERM.
+static int check_path(const char *path) {
+    char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char *slash;
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL)
+        strcpy(dir, ".");
+    else
+        slash[slash == dir] = '\0';   // keep "/" itself
+    if (lstat(dir, &st) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode) || (st.st_uid != geteuid() && st.st_uid != 0) ||
+        ((st.st_mode & (S_IWGRP | S_IWOTH)) && !(st.st_mode & S_ISVTX)))
+        goto unsafe;
+    if (lstat(path, &st) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid())
+        goto unsafe;
+    return 1;
+unsafe:
+    errno = EPERM;
+    return -1;
+}
+
+static int listen_at(const char *path, const char *suffix, int flags, int backlog) {
+    struct sockaddr_un sun;
+    int fd, found;
+
+    if (local_addr(&sun, path, suffix) < 0)
+        return -1;
+    // The default directory is ours to make; any other must exist.
+    if (strcmp(path, local_default_path()) == 0) {
+        char dir[sizeof(sun.sun_path)];
+
+        snprintf(dir, sizeof(dir), "%s", path);
+        *strrchr(dir, '/') = '\0';
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+            return -1;
+    }
+    if ((found = check_path(sun.sun_path)) < 0 ||
+        (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0)) < 0)
+        return -1;
+    if (found)
+        unlink(sun.sun_path);   // our own stale socket from an earlier run
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_to(const char *path, const char *suffix) {
+    struct sockaddr_un sun;
+    int fd;
+
+    if (local_addr(&sun, path, suffix) < 0 || check_path(sun.sun_path) <= 0 ||
+        (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int local_listen(const char *path, const struct listen_opts *o) {
+    return listen_at(path, "", SOCK_NONBLOCK, o->backlog);
+}
+
+int local_connect(const char *path) {
+    return connect_to(path, "");
+}
+
+/*-------------------------------------------------
+ * Shared-memory rings
+ *-------------------------------------------------*/
+
+static void futex_wait(uint32_t *word, uint32_t val, int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    // Not FUTEX_PRIVATE: the word lives in memory shared between processes.
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// True once the peer has closed the region or its process has exited.
+static int peer_gone(struct shm_chan *ch) {
+    char c;
+
+    return __atomic_load_n(&ch->map->closed, __ATOMIC_ACQUIRE) ||
+           recv(ch->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Wait until *word differs from seen. The flag is raised before the
+// final check, pairing with the other side's store-then-load of it in
+// shm_publish(), so a wake-up can never fall between the two.
+// Returns 0 when it changed, or -1 on timeout or if the peer is gone.
+static int shm_wait(struct shm_chan *ch, uint32_t *word, uint32_t *asleep,
+                    uint32_t seen, int timeout_ms) {
+    uint64_t deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+
+    // Spinning only pays if the peer can make progress meanwhile.
+    if (shm_spin < 0)
+        shm_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    for (int spin = 0; spin < shm_spin; spin++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+            return 0;
+        cpu_relax();
+    }
+    for (;;) {
+        int ms = SHM_CHECK_MS;
+
+        if (timeout_ms >= 0) {
+            uint64_t now = now_ms();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (deadline - now < (uint64_t)ms)
+                ms = (int)(deadline - now);
+        }
+        __atomic_store_n(asleep, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+            futex_wait(word, seen, ms);
+        __atomic_store_n(asleep, 0, __ATOMIC_RELAXED);
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen)
+            return 0;
+        if (peer_gone(ch)) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
+
+// Make a new index visible and wake the other side only if it sleeps.
+static void shm_publish(uint32_t *word, uint32_t *asleep, uint32_t val) {
+    __atomic_store_n(word, val, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(asleep, __ATOMIC_SEQ_CST))
+        futex_wake(word);
+}
+
+ssize_t shm_read(struct shm_chan *ch, void *buf, size_t len, int timeout_ms) {
+    struct shm_ring *r = ch->rx;
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t n, first;
+
+    while (tail == head) {
+        if (shm_wait(ch, &r->tail, &r->reader_asleep, head, timeout_ms) < 0)
+            return errno == EPIPE ? 0 : -1;
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    }
+
+    // The peer can write the indices, so never trust them further than
+    // the ring itself.
+    n = tail - head < len ? tail - head : len;
+    if (n > SHM_RING)
+        n = SHM_RING;
+    first = SHM_RING - (head & (SHM_RING - 1));
+    if (first > n)
+        first = n;
+    memcpy(buf, r->data + (head & (SHM_RING - 1)), first);
+    memcpy((char *)buf + first, r->data, n - first);
+    shm_publish(&r->head, &r->writer_asleep, head + (uint32_t)n);
+    return n;
+}
+
+// Copy as much of the pieces as fits, publishing once for all of them,
+// and wait for room only when the ring is full.
+static int shm_writev(struct shm_chan *ch, const char **data, size_t *len, int count) {
+    struct shm_ring *r = ch->tx;
+    uint32_t tail = r->tail;
+
+    for (int i = 0; i < count; i++) {
+        while (len[i] > 0) {
+            uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            size_t room = SHM_RING - (tail - head);
+            size_t n, off, first;
+
+            if (tail - head > SHM_RING) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (room == 0) {
+                shm_publish(&r->tail, &r->reader_asleep, tail);
+                if (shm_wait(ch, &r->head, &r->writer_asleep, head, -1) < 0)
+                    return -1;
+                continue;
+            }
+            n = len[i] < room ? len[i] : room;
+            off = tail & (SHM_RING - 1);
+            first = SHM_RING - off < n ? SHM_RING - off : n;
+            memcpy(r->data + off, data[i], first);
+            memcpy(r->data, data[i] + first, n - first);
+            tail += (uint32_t)n;
+            data[i] += n;
+            len[i] -= n;
+        }
+    }
+    shm_publish(&r->tail, &r->reader_asleep, tail);
+    return 0;
+}
+
+int shm_send_frame(struct shm_chan *ch, const void *payload, size_t len) {
+    char hdr[FRAME_HDR];
+    const char *data[2] = { hdr, payload };
+    size_t lens[2] = { FRAME_HDR, len };
+
+    frame_put_header(hdr, (uint32_t)len);
+    return shm_writev(ch, data, lens, 2);
+}
+
+void shm_close(struct shm_chan *ch) {
+    struct shm_region *m = ch->map;
+
+    __atomic_store_n(&m->closed, 1, __ATOMIC_RELEASE);
+    futex_wake(&m->up.tail);
+    futex_wake(&m->up.head);
+    futex_wake(&m->down.tail);
+    futex_wake(&m->down.head);
+    munmap(m, sizeof(*m));
+    close(ch->sock);
+}
+
+/*-------------------------------------------------
+ * Handshake: the client passes the memfd over a UNIX socket
+ *-------------------------------------------------*/
+
+int shm_connect(struct shm_chan *ch, const char *path) {
+    char byte = 0, cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    int memfd, err;
+
+    if ((ch->sock = connect_to(path, SHM_SUFFIX)) < 0)
+        return -1;
+    if ((memfd = memfd_create("hw4-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        goto fail;
+    // Sealed at its size, so the server can map it without fearing a
+    // later ftruncate turning its ring accesses into SIGBUS.
+    if (ftruncate(memfd, sizeof(struct shm_region)) < 0 ||
+        fcntl(memfd, F_ADD_SEALS, SHM_SEALS) < 0 ||
+        (ch->map = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        close(memfd);
+        goto fail;
+    }
+    ch->tx = &ch->map->up;
+    ch->rx = &ch->map->down;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+
+    // The mapping keeps the region alive; the server acknowledges once
+    // it has mapped its own view.
+    if (sendmsg(ch->sock, &msg, MSG_NOSIGNAL) != 1 || recv(ch->sock, &byte, 1, 0) != 1) {
+        if (errno == 0)
+            errno = ECONNRESET;
+        close(memfd);
+        munmap(ch->map, sizeof(struct shm_region));
+        goto fail;
+    }
+    close(memfd);
+    return 0;
+
+fail:
+    err = errno;
+    close(ch->sock);
+    errno = err;
+    return -1;
+}
+
+// Take the client's memfd and map it. Returns 0, or -1 on any failure.
+static int shm_accept(struct shm_chan *ch) {
+    char byte, cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    struct stat st;
+    int memfd = -1;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(ch->sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&memfd, CMSG_DATA(cm), sizeof(int));
+
+    // Never trust the size of what a client sends, nor that it stays so:
+    // only a region sealed against resizing is mapped.
+    if (fstat(memfd, &st) < 0 || st.st_size != sizeof(struct shm_region) ||
+        (fcntl(memfd, F_GET_SEALS) & SHM_SEALS) != SHM_SEALS ||
+        (ch->map = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+    close(memfd);
+    ch->rx = &ch->map->up;
+    ch->tx = &ch->map->down;
+    if (send(ch->sock, &byte, 1, MSG_NOSIGNAL) != 1) {
+        munmap(ch->map, sizeof(struct shm_region));
+        return -1;
+    }
+    return 0;
+}
+
+static void *shm_session(void *arg) {
+    struct shm_chan *ch = arg;
+    struct frame_parser rx = { 0 };
+    char *buf = malloc(SHM_RECV);
+    ssize_t n;
+    int rc;
+
+    if (shm_accept(ch) < 0) {
+        close(ch->sock);
+        free(ch);
+        free(buf);
+        __atomic_sub_fetch(&shm_sessions, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    printf("New shared-memory client connected. Socket: %d\n", ch->sock);
+    while (buf && (n = shm_read(ch, buf, SHM_RECV, -1)) > 0) {
+        if ((rc = frame_feed(&rx, buf, n, shm_cb, ch)) != 0) {
+            if (rc < 0)
+                printf("[Client %d] Bad frame: %s\n", ch->sock, strerror(errno));
+            break;
+        }
+    }
+    printf("[Client %d] Disconnected.\n", ch->sock);
+    frame_parser_reset(&rx);
+    shm_close(ch);
+    free(ch);
+    free(buf);
+    __atomic_sub_fetch(&shm_sessions, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Each shared-memory client is served by a thread of its own: a ring has
+// no descriptor for an event loop to wait on, so it is read the way the
+// thread-per-client model reads a socket. The threads are capped at
+// SHM_MAX_SESSIONS so a burst of clients cannot exhaust the process.
+static void *shm_acceptor(void *arg) {
+    (void)arg;
+    while (1) {
+        struct shm_chan *ch;
+        pthread_t tid;
+        int fd = accept4(shm_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("shm accept failed");
+            continue;
+        }
+        if (__atomic_load_n(&shm_sessions, __ATOMIC_RELAXED) >= SHM_MAX_SESSIONS) {
+            printf("Too many shared-memory clients. Closing socket %d\n", fd);
+            close(fd);
+            continue;
+        }
+        if (!(ch = calloc(1, sizeof(*ch)))) {
+            close(fd);
+            continue;
+        }
+        ch->sock = fd;
+        __atomic_add_fetch(&shm_sessions, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&tid, NULL, shm_session, ch) != 0) {
+            perror("pthread_create failed");
+            __atomic_sub_fetch(&shm_sessions, 1, __ATOMIC_RELAXED);
+            close(fd);
+            free(ch);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+int shm_serve(const char *path, frame_cb cb) {
+    pthread_t tid;
+
+    if ((shm_listen_fd = listen_at(path, SHM_SUFFIX, 0, 64)) < 0)
+        return -1;
+    shm_cb = cb;
+    if ((errno = pthread_create(&tid, NULL, shm_acceptor, NULL)) != 0) {
+        close(shm_listen_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,93 @@
+// local.h
+// Transports for clients on the same host as the server.
+//
+// A UNIX-domain stream socket carries the same framed byte stream as TCP
+// but skips the loopback TCP/IP stack. The shared-memory transport goes
+// further: the stream travels through a pair of ring buffers in a memfd
+// mapped by both processes, so a message costs two memcpys and no system
+// call at all while the reader is awake. A reader that finds its ring
+// empty spins briefly and then sleeps on a futex; the writer only makes
+// the wake-up call when someone is actually asleep.
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "framing.h"
+#include "tune.h"
+
+#define LOCAL_NAME  "hw4.sock"       // default UNIX-domain listener, in local_dir()
+#define SHM_SUFFIX  ".shm"           // appended for the shared-memory handshake
+#define SHM_RING    (1u << 20)       // bytes per direction (power of 2)
+#define SHM_MAX_SESSIONS 64          // shared-memory clients served at once
+
+// One direction of a shared-memory stream. head and tail are free-running
+// byte counts that double as futex words: an idle reader sleeps on tail,
+// a writer facing a full ring sleeps on head. Each side's index is on its
+// own cache line so the two never contend for one.
+struct shm_ring {
+    uint32_t tail __attribute__((aligned(64)));  // written by the producer
+    uint32_t reader_asleep;
+    uint32_t head __attribute__((aligned(64)));  // written by the consumer
+    uint32_t writer_asleep;
+    char data[SHM_RING] __attribute__((aligned(64)));
+};
+
+// The memfd shared by a client and the server: up carries client to
+// server, down server to client.
+struct shm_region {
+    struct shm_ring up, down;
+    uint32_t closed;                 // set by whichever side leaves first
+};
+
+// One end of a shared-memory connection. The handshake socket stays open
+// for the connection's lifetime: it is how a sleeping side notices that
+// its peer died without closing the region.
+struct shm_chan {
+    struct shm_region *map;
+    struct shm_ring *rx, *tx;
+    int sock;
+};
+
+// The default listener path: LOCAL_NAME in $XDG_RUNTIME_DIR, or else in
+// /tmp/hw4-<uid>, a directory only this user may enter. Either way
+// another user can't take the name first or stand in for the server.
+const char *local_default_path(void);
+
+// Bind a UNIX-domain stream listener at path, replacing a stale socket
+// file. The default directory is created if need be. Any path must be
+// in a directory owned by this user or root that others can't replace
+// files in, and an existing file is only removed if it is this user's
+// socket. Returns the non-blocking listener, or -1 with errno set
+// (EPERM if a check failed).
+int local_listen(const char *path, const struct listen_opts *o);
+
+// Connect to a UNIX-domain listener, if it is this user's socket in a
+// directory as above. Returns a blocking socket or -1 (EPERM if not).
+int local_connect(const char *path);
+
+// Client: create a region and hand it to the server listening at
+// path SHM_SUFFIX. Returns 0, or -1 with errno set.
+int shm_connect(struct shm_chan *ch, const char *path);
+
+// Server: accept shared-memory clients at path SHM_SUFFIX on a thread of
+// its own and serve each with a thread that feeds its frames to cb, with
+// the struct shm_chan as ctx. At most SHM_MAX_SESSIONS clients are served
+// at once; one over the limit has its socket closed before the handshake,
+// so its shm_connect fails. Returns 0 once listening, or -1.
+int shm_serve(const char *path, frame_cb cb);
+
+// Read up to len bytes, waiting at most timeout_ms (-1 = forever) for
+// the first. Returns the count, 0 once the peer has gone, or -1 with
+// errno ETIMEDOUT.
+ssize_t shm_read(struct shm_chan *ch, void *buf, size_t len, int timeout_ms);
+
+// Write all of one frame, waiting for room as needed. Returns 0, or -1
+// (errno EPIPE) if the peer goes away first.
+int shm_send_frame(struct shm_chan *ch, const void *payload, size_t len);
+
+// Close our end and wake the peer so it sees the connection is gone.
+void shm_close(struct shm_chan *ch);
+
+#endif
@@ -0,0 +1,223 @@
+// metrics.c
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+// Histogram buckets exported: 1 us to about 1 s, doubling.
+#define EXPORT_BUCKETS  21
+#define SEND_TIMEOUT_MS 1000    // a scraper that stops reading is dropped
+
+static struct metrics *registered[METRICS_MAX];
+static int nregistered;
+static void (*extra_gauges)(FILE *out);
+static int listen_fd = -1;
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_register(struct metrics *m) {
+    int i = __atomic_fetch_add(&nregistered, 1, __ATOMIC_RELAXED);
+
+    if (i < METRICS_MAX)
+        __atomic_store_n(&registered[i], m, __ATOMIC_RELEASE);
+}
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+// Sum every registered block into sum, histogram included.
+static void metrics_collect(struct metrics *sum) {
+    int n = LOAD(nregistered);
+
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < n && i < METRICS_MAX; i++) {
+        struct metrics *m = __atomic_load_n(&registered[i], __ATOMIC_ACQUIRE);
+        uint64_t max;
+
+        if (!m)
+            continue;
+        sum->accepted += LOAD(m->accepted);
+        sum->closed += LOAD(m->closed);
+        sum->bytes_in += LOAD(m->bytes_in);
+        sum->msgs_in += LOAD(m->msgs_in);
+        sum->out.queued += LOAD(m->out.queued);
+        sum->out.written += LOAD(m->out.written);
+        sum->out.messages += LOAD(m->out.messages);
+        sum->out.dropped += LOAD(m->out.dropped);
+        for (unsigned b = 0; b < HIST_BUCKETS; b++)
+            sum->handle_ns.counts[b] += LOAD(m->handle_ns.counts[b]);
+        sum->handle_ns.total += LOAD(m->handle_ns.total);
+        sum->handle_ns.sum += LOAD(m->handle_ns.sum);
+        if ((max = LOAD(m->handle_ns.max)) > sum->handle_ns.max)
+            sum->handle_ns.max = max;
+    }
+}
+
+static void put_metric(FILE *out, const char *name, const char *type, const char *help,
+                       uint64_t value) {
+    fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n" METRICS_PREFIX "%s %llu\n",
+            name, help, name, type, name, (unsigned long long)value);
+}
+
+// Prometheus buckets are cumulative and in seconds. Each exported bound
+// takes every log-linear bucket lying wholly below it, so counts are
+// exact to within one sub-bucket (about 1.6%).
+static void put_histogram(FILE *out, const char *name, const char *help, const struct hist *h) {
+    uint64_t seen = 0, bound = 1000;
+    unsigned b = 0;
+
+    fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n", name, help, name);
+    for (int i = 0; i < EXPORT_BUCKETS; i++, bound *= 2) {
+        for (; b < HIST_BUCKETS && hist_bucket_value(b) < bound; b++)
+            seen += h->counts[b];
+        fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name, bound / 1e9,
+                (unsigned long long)seen);
+    }
+    fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->total);
+    fprintf(out, METRICS_PREFIX "%s_sum %.9f\n", name, h->sum / 1e9);
+    fprintf(out, METRICS_PREFIX "%s_count %llu\n", name, (unsigned long long)h->total);
+}
+
+static void metrics_write(FILE *out, const struct metrics *m) {
+    put_metric(out, "connections_accepted_total", "counter", "Connections accepted.", m->accepted);
+    put_metric(out, "connections_closed_total", "counter", "Connections closed.", m->closed);
+    put_metric(out, "connections_active", "gauge", "Connections open now.",
+               m->accepted - m->closed);
+    put_metric(out, "received_bytes_total", "counter", "Bytes read from clients.", m->bytes_in);
+    put_metric(out, "received_messages_total", "counter", "Frames read from clients.",
+               m->msgs_in);
+    put_metric(out, "sent_bytes_total", "counter", "Bytes written to clients.", m->out.written);
+    put_metric(out, "sent_messages_total", "counter", "Frames written to clients.",
+               m->out.messages);
+    put_metric(out, "dropped_messages_total", "counter",
+               "Frames dropped for slow consumers.", m->out.dropped);
+    put_metric(out, "output_queued_bytes", "gauge", "Bytes waiting in output queues.",
+               m->out.queued);
+    put_histogram(out, "message_handling_seconds", "Time to handle one client message.",
+                  &m->handle_ns);
+}
+
+// A scraper that hangs up early must not take the server with it.
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *metrics_loop(void *arg) {
+    struct metrics *sum = malloc(sizeof(*sum));
+
+    (void)arg;
+    if (!sum) {
+        perror("malloc failed");
+        return NULL;
+    }
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        struct timeval tv = { 0, 100000 };
+        struct timeval send_tv = { SEND_TIMEOUT_MS / 1000, SEND_TIMEOUT_MS % 1000 * 1000 };
+        char req[1024], *text = NULL;
+        size_t len = 0;
+        ssize_t n;
+        FILE *out;
+
+        if (fd < 0) {
+            if (errno != EINTR)
+                perror("metrics accept");
+            continue;
+        }
+        // Every connection gets a scrape. A client that sends an HTTP
+        // request first (curl --unix-socket, a scraping proxy) gets an
+        // HTTP response; one that sends nothing gets the bare text.
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_tv, sizeof(send_tv));
+        n = recv(fd, req, sizeof(req), 0);
+        metrics_collect(sum);
+        if ((out = open_memstream(&text, &len)) != NULL) {
+            if (n >= 4 && memcmp(req, "GET ", 4) == 0)
+                fputs("HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n\r\n", out);
+            metrics_write(out, sum);
+            if (extra_gauges)
+                extra_gauges(out);
+            fclose(out);
+            write_all(fd, text, len);
+            free(text);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Remove a socket left at path by an earlier run. Anything else there,
+// including a socket some live server still accepts on, is left alone.
+static int remove_stale(const struct sockaddr_un *sun) {
+    struct stat st;
+    int fd, rc;
+
+    if (lstat(sun->sun_path, &st) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    rc = connect(fd, (const struct sockaddr *)sun, sizeof(*sun));
+    close(fd);
+    if (rc == 0) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (errno != ECONNREFUSED)
+        return -1;
+    return unlink(sun->sun_path);
+}
+
+int metrics_serve(const char *path, void (*extra)(FILE *out)) {
+    struct sockaddr_un sun;
+    pthread_t tid;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if (remove_stale(&sun) < 0 ||
+        (listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(listen_fd, 16) < 0) {
+        close(listen_fd);
+        return -1;
+    }
+    extra_gauges = extra;
+    if ((errno = pthread_create(&tid, NULL, metrics_loop, NULL)) != 0) {
+        close(listen_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,57 @@
+// metrics.h
+// Per-thread server metrics, served in Prometheus text format.
+//
+// Every loop thread owns one struct metrics, aligned and padded to whole
+// cache lines so that no two threads ever write the same line. Only the
+// owner writes it, with plain relaxed stores, so recording a metric is
+// an add: no lock and no atomic read-modify-write. A scrape sums every
+// registered block with relaxed loads; it may miss events still in
+// flight but never sees a torn value.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "hist.h"
+#include "outq.h"
+
+#define METRICS_MAX     256     // registered threads
+#define METRICS_PREFIX  "hw4_"  // on every exported name
+
+struct metrics {
+    uint64_t accepted;          // connections; active = accepted - closed
+    uint64_t closed;
+    uint64_t bytes_in;
+    uint64_t msgs_in;
+    struct outq_totals out;     // attached to each connection's queue
+    struct hist handle_ns;      // time to handle one client message
+} __attribute__((aligned(64)));
+
+#define METRIC_ADD(m, field, n) \
+    __atomic_store_n(&(m)->field, (m)->field + (n), __ATOMIC_RELAXED)
+
+static inline void metric_observe(struct hist *h, uint64_t v) {
+    unsigned i = hist_index(v);
+
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// Monotonic nanoseconds, for handle_ns.
+uint64_t metrics_now(void);
+
+// Include m in every scrape. Call before the owning thread starts.
+void metrics_register(struct metrics *m);
+
+// Serve the sum of all registered metrics on a UNIX-domain stream socket
+// at path, one exposition per connection (e.g. `curl --unix-socket`).
+// extra, if set, appends server-specific gauges such as queue depths.
+// A socket already at path is replaced only if nothing accepts on it
+// (EADDRINUSE if something does, EEXIST if it is not a socket).
+// Returns 0 once the serving thread is running, or -1 with errno set.
+int metrics_serve(const char *path, void (*extra)(FILE *out));
+
+#endif
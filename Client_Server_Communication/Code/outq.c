@@ -0,0 +1,431 @@
+// outq.c
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "framing.h"
+#include "outq.h"
+
+#define OUTQ_IOV  64    // segments gathered per sendmsg
+
+#define TOTAL_ADD(q, field, n) do {                                             \
+        if ((q)->totals)                                                        \
+            __atomic_store_n(&(q)->totals->field, (q)->totals->field + (n),     \
+                             __ATOMIC_RELAXED);                                 \
+    } while (0)
+#define OUTQ_FILE_CHUNK  (1 << 20)  // most file bytes per sendfile, so one
+                                    // stream can't monopolise the loop
+#define OUTQ_LINGER_SECS 120        // longest a cleared queue waits for its
+                                    // zero-copy completions
+
+// A queue cleared while zero-copy sends were in flight. It keeps the
+// buffers the kernel may still be reading, and a duplicate of the socket
+// so the completions can be read after the caller closes its descriptor.
+struct outq_linger {
+    struct outq q;          // only the zero-copy ring is left in it
+    int fd;
+    time_t deadline;
+    struct outq_linger *next;
+};
+
+static __thread struct outq_linger *lingering;
+
+struct msgbuf *msgbuf_new(size_t len) {
+    struct msgbuf *b = malloc(sizeof(*b) + len);
+
+    if (!b)
+        return NULL;
+    b->refs = 1;
+    b->len = len;
+    return b;
+}
+
+struct msgbuf *msgbuf_frame(const void *payload, size_t len) {
+    struct msgbuf *b = msgbuf_new(FRAME_HDR + len);
+
+    if (!b)
+        return NULL;
+    frame_put_header(b->data, (uint32_t)len);
+    memcpy(b->data + FRAME_HDR, payload, len);
+    return b;
+}
+
+void msgbuf_unref(struct msgbuf *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(b);
+}
+
+struct filebuf *filebuf_open(const char *path) {
+    struct filebuf *f = malloc(sizeof(*f) + strlen(path) + 1);
+    struct stat st;
+    int ok;
+
+    if (!f)
+        return NULL;
+    if ((f->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        free(f);
+        return NULL;
+    }
+    ok = fstat(f->fd, &st) == 0;
+    if (!ok || !S_ISREG(st.st_mode)) {
+        if (ok)
+            errno = EINVAL;     // only regular files can be sent
+        close(f->fd);
+        free(f);
+        return NULL;
+    }
+    f->refs = 1;
+    f->size = st.st_size;
+    f->sent = 0;
+    f->progress = NULL;
+    f->target = -1;
+    f->reported = 0;
+    strcpy(f->name, path);
+    return f;
+}
+
+void filebuf_unref(struct filebuf *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+static void outseg_release(struct outseg *seg) {
+    if (seg->file)
+        filebuf_unref(seg->file);
+    else
+        msgbuf_unref(seg->buf);
+}
+
+static int outq_grow(struct outq *q) {
+    unsigned ncap = q->cap ? q->cap * 2 : 8;
+    struct outseg *nring = malloc(sizeof(*nring) * ncap);
+    unsigned n = q->tail - q->head;
+
+    if (!nring)
+        return -1;
+    for (unsigned i = 0; i < n; i++)
+        nring[i] = q->ring[(q->head + i) & (q->cap - 1)];
+    free(q->ring);
+    q->ring = nring;
+    q->cap = ncap;
+    q->head = 0;
+    q->tail = n;
+    return 0;
+}
+
+int outq_flush(struct outq *q, int fd, const struct outq_limits *lim) {
+    struct iovec iov[OUTQ_IOV];
+    struct msghdr msg;
+    int drained = 1;
+
+    while (!outq_empty(q)) {
+        unsigned n = 0;
+        size_t total = 0;
+        ssize_t sent;
+        int zc;
+
+        if (outq_head_file(q)) {
+            // The kernel copies straight from the page cache.
+            struct outseg *seg = &q->ring[q->head & (q->cap - 1)];
+            off_t pos = seg->start + seg->off;
+            size_t left = seg->len - seg->off;
+
+            sent = sendfile(fd, seg->file->fd, &pos, left < OUTQ_FILE_CHUNK ? left : OUTQ_FILE_CHUNK);
+            if (sent == 0) {
+                errno = EIO;    // the file shrank under us
+                return -1;
+            }
+        } else {
+            for (unsigned i = q->head; i != q->tail && n < OUTQ_IOV; i++, n++) {
+                struct outseg *seg = &q->ring[i & (q->cap - 1)];
+                if (seg->file)
+                    break;
+                iov[n].iov_base = seg->buf->data + seg->off;
+                iov[n].iov_len = seg->len - seg->off;
+                total += iov[n].iov_len;
+            }
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            // Pinning pages only pays off for large writes; small ones
+            // are cheaper to copy than to track until completion.
+            zc = q->zc_min && total >= q->zc_min && outq_zc_reserve(q, n) == 0;
+            sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (zc ? MSG_ZEROCOPY : 0));
+            if (sent < 0 && zc && errno == ENOBUFS) {
+                // Too many completions outstanding; copy this one.
+                zc = 0;
+                sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+            if (sent > 0 && zc)
+                outq_zc_hold(q, sent);
+        }
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            drained = 0;
+            break;
+        }
+
+        outq_consume(q, sent, lim);
+    }
+
+    return drained;
+}
+
+void outq_consume(struct outq *q, size_t n, const struct outq_limits *lim) {
+    q->bytes -= n;
+    TOTAL_ADD(q, queued, -(uint64_t)n);
+    TOTAL_ADD(q, written, n);
+    while (n > 0) {
+        struct outseg *seg = &q->ring[q->head & (q->cap - 1)];
+        size_t left = seg->len - seg->off;
+        size_t take = n < left ? n : left;
+
+        if (seg->file) {
+            q->file_bytes -= take;
+            seg->file->sent += take;
+            if (seg->file->progress)
+                seg->file->progress(seg->file);
+        }
+        if (n < left) {
+            seg->off += n;
+            break;
+        }
+        n -= left;
+        if (!seg->file)
+            TOTAL_ADD(q, messages, 1);
+        outseg_release(seg);
+        q->head++;
+    }
+
+    if (q->blocked && q->bytes - q->file_bytes <= lim->low)
+        q->blocked = 0;
+}
+
+// Apply the slow-consumer policy before queueing. Returns 0 if there is
+// room, otherwise what outq_push() should return.
+static int outq_admit(struct outq *q, const struct outq_limits *lim) {
+    if (q->blocked || q->bytes - q->file_bytes >= lim->high) {
+        if (lim->policy == OUTQ_CLOSE)
+            return -1;
+        // Hysteresis: once a peer hits the high watermark it gets nothing
+        // new until it has drained to the low one.
+        q->blocked = 1;
+        q->dropped++;
+        TOTAL_ADD(q, dropped, 1);
+        return 1;
+    }
+    if (q->tail - q->head == q->cap && outq_grow(q) < 0)
+        return -1;
+    return 0;
+}
+
+int outq_push(struct outq *q, struct msgbuf *b, const struct outq_limits *lim) {
+    struct outseg *seg;
+    int rc = outq_admit(q, lim);
+
+    if (rc)
+        return rc;
+    seg = &q->ring[q->tail++ & (q->cap - 1)];
+    seg->buf = msgbuf_ref(b);
+    seg->file = NULL;
+    seg->len = b->len;
+    seg->off = 0;
+    q->bytes += b->len;
+    TOTAL_ADD(q, queued, b->len);
+    return 0;
+}
+
+int outq_push_file(struct outq *q, struct filebuf *f, off_t start, size_t len) {
+    struct outseg *seg;
+
+    if (q->tail - q->head == q->cap && outq_grow(q) < 0)
+        return -1;
+    seg = &q->ring[q->tail++ & (q->cap - 1)];
+    seg->buf = NULL;
+    seg->file = filebuf_ref(f);
+    seg->start = start;
+    seg->len = len;
+    seg->off = 0;
+    q->bytes += len;
+    q->file_bytes += len;
+    TOTAL_ADD(q, queued, len);
+    return 0;
+}
+
+int outq_send(struct outq *q, int fd, struct msgbuf *b, const struct outq_limits *lim) {
+    if (outq_push(q, b, lim) < 0)
+        return -1;
+    return outq_flush(q, fd, lim);
+}
+
+int outq_zerocopy(struct outq *q, int fd, size_t min) {
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+        return -1;
+    q->zc_min = min;
+    return 0;
+}
+
+int outq_zc_reserve(struct outq *q, unsigned n) {
+    unsigned used = q->zc_tail - q->zc_head;
+
+    if (q->zc_cap - used < n) {
+        unsigned ncap = q->zc_cap ? q->zc_cap : 8;
+        struct zcref *nzc;
+
+        while (ncap - used < n)
+            ncap *= 2;
+        if (!(nzc = malloc(sizeof(*nzc) * ncap)))
+            return -1;
+        for (unsigned i = 0; i < used; i++)
+            nzc[i] = q->zc[(q->zc_head + i) & (q->zc_cap - 1)];
+        free(q->zc);
+        q->zc = nzc;
+        q->zc_cap = ncap;
+        q->zc_head = 0;
+        q->zc_tail = used;
+    }
+    return 0;
+}
+
+// Room was made by outq_zc_reserve() before the send.
+static void outq_zc_add(struct outq *q, struct msgbuf *b, uint32_t id) {
+    q->zc[q->zc_tail++ & (q->zc_cap - 1)] = (struct zcref){ msgbuf_ref(b), id };
+}
+
+void outq_zc_hold(struct outq *q, size_t n) {
+    uint32_t id = q->zc_next++;
+
+    for (unsigned i = q->head; n > 0 && i != q->tail; i++) {
+        struct outseg *seg = &q->ring[i & (q->cap - 1)];
+        size_t left = seg->len - seg->off;
+
+        outq_zc_add(q, seg->buf, id);
+        n -= n < left ? n : left;
+    }
+}
+
+void outq_zc_done(struct outq *q, uint32_t id) {
+    while (outq_zc_pending(q)) {
+        struct zcref *z = &q->zc[q->zc_head & (q->zc_cap - 1)];
+
+        if ((int32_t)(z->id - id) > 0)
+            break;
+        msgbuf_unref(z->buf);
+        q->zc_head++;
+    }
+    q->zc_acked = id + 1;
+}
+
+int outq_reap(struct outq *q, int fd) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    socklen_t elen = sizeof(int);
+    int err = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;              // EAGAIN: the error queue is empty
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+                continue;
+            // Sends ee_info..ee_data are done. If the kernel had to copy
+            // anyway (e.g. over loopback), pinning is pure overhead.
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                q->zc_min = 0;
+            outq_zc_done(q, ee->ee_data);
+        }
+    }
+
+    // EPOLLERR is also how a real socket error shows up.
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err)
+        return -1;
+    return 0;
+}
+
+void outq_clear(struct outq *q, int fd) {
+    struct outq_linger *l = NULL;
+
+    TOTAL_ADD(q, queued, -(uint64_t)q->bytes);
+    while (!outq_empty(q)) {
+        outseg_release(&q->ring[q->head & (q->cap - 1)]);
+        q->head++;
+    }
+    free(q->ring);
+    q->ring = NULL;
+
+    // Freed now, buffers the kernel is still sending from could be
+    // reused and their new contents sent instead.
+    if (outq_zc_pending(q) && fd >= 0 && (l = malloc(sizeof(*l))) != NULL &&
+        (l->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        shutdown(fd, SHUT_RDWR);    // the duplicate must not keep it open
+        l->q = *q;
+        l->q.totals = NULL;
+        l->deadline = ts.tv_sec + OUTQ_LINGER_SECS;
+        l->next = lingering;
+        lingering = l;
+        memset(q, 0, sizeof(*q));
+        return;
+    }
+    free(l);
+    while (outq_zc_pending(q)) {
+        msgbuf_unref(q->zc[q->zc_head & (q->zc_cap - 1)].buf);
+        q->zc_head++;
+    }
+    free(q->zc);
+    memset(q, 0, sizeof(*q));
+}
+
+int outq_linger_reap(void) {
+    struct outq_linger **pp = &lingering, *l;
+    struct timespec ts;
+    int left = 0;
+
+    if (!lingering)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    while ((l = *pp) != NULL) {
+        outq_reap(&l->q, l->fd);
+        // A peer that never acknowledges would hold them for good.
+        if (outq_zc_pending(&l->q) && ts.tv_sec < l->deadline) {
+            pp = &l->next;
+            left++;
+            continue;
+        }
+        *pp = l->next;
+        outq_clear(&l->q, -1);
+        close(l->fd);
+        free(l);
+    }
+    return left;
+}
@@ -0,0 +1,188 @@
+// outq.h
+// Per-connection output queues for non-blocking sockets.
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Immutable, reference-counted bytes (usually one or more whole frames).
+// A buffer can sit in many output queues at once without being copied.
+struct msgbuf {
+    unsigned refs;
+    size_t len;
+    char data[];
+};
+
+struct msgbuf *msgbuf_new(size_t len);
+
+// A buffer holding a single frame (header + payload).
+struct msgbuf *msgbuf_frame(const void *payload, size_t len);
+
+static inline struct msgbuf *msgbuf_ref(struct msgbuf *b) {
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+void msgbuf_unref(struct msgbuf *b);
+
+// An open file streamed to a socket with sendfile(), so its contents
+// never pass through user space. One reference is held per queued range.
+struct filebuf {
+    unsigned refs;
+    int fd;
+    off_t size;             // bytes in the file
+    off_t sent;             // bytes written so far, over all ranges
+    // Called from outq_consume() whenever sent advances; may be NULL.
+    void (*progress)(struct filebuf *f);
+    int target;             // free for the progress callback's use
+    int reported;
+    char name[];
+};
+
+// Open path for streaming. Returns NULL with errno set on failure.
+struct filebuf *filebuf_open(const char *path);
+
+static inline struct filebuf *filebuf_ref(struct filebuf *f) {
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+void filebuf_unref(struct filebuf *f);
+
+// A queued run of bytes: part of a buffer, or a range of a file.
+struct outseg {
+    struct msgbuf *buf;     // NULL for a file range
+    struct filebuf *file;
+    off_t start;            // file range: first byte
+    size_t len;             // bytes in the segment
+    size_t off;             // bytes of the segment already written
+};
+
+// A buffer lent to the kernel by a zero-copy send. The kernel pins its
+// pages instead of copying them, so it is kept alive until the send with
+// this id is reported complete.
+struct zcref {
+    struct msgbuf *buf;
+    uint32_t id;
+};
+
+// Running totals over every queue one thread owns, for its metrics.
+// Only that thread writes them (relaxed stores); anyone may read them.
+struct outq_totals {
+    uint64_t queued;        // bytes waiting, not yet written
+    uint64_t written;       // bytes handed to the kernel
+    uint64_t messages;      // buffers fully written
+    uint64_t dropped;       // messages discarded by OUTQ_DROP
+};
+
+// Ring buffer of pending segments, flushed with one sendmsg per call.
+struct outq {
+    struct outseg *ring;
+    unsigned head, tail;    // free-running; ring index is & (cap - 1)
+    unsigned cap;           // power of two, grown on demand
+    size_t bytes;           // queued bytes not yet written
+    size_t file_bytes;      // how many of those are file ranges
+    int blocked;            // above the high watermark, not yet below low
+    unsigned long dropped;  // messages discarded by OUTQ_DROP
+    size_t zc_min;          // sendmsg calls of this many bytes or more use
+                            // MSG_ZEROCOPY; 0 = always copy
+    struct zcref *zc;       // buffers the kernel may still be reading
+    unsigned zc_head, zc_tail, zc_cap;
+    uint32_t zc_next;       // id of the next zero-copy send
+    uint32_t zc_acked;      // every send before this id has completed
+    struct outq_totals *totals; // optional; outq_clear() detaches it
+};
+
+// What to do with a peer whose queue reaches the high watermark.
+enum outq_policy { OUTQ_DROP, OUTQ_CLOSE };
+
+struct outq_limits {
+    size_t high;
+    size_t low;
+    enum outq_policy policy;
+};
+
+static inline int outq_empty(const struct outq *q) {
+    return q->head == q->tail;
+}
+
+// Queue b (taking a new reference) without writing it. Returns 0 if it was
+// queued, 1 if OUTQ_DROP discarded it, or -1 if OUTQ_CLOSE applies.
+int outq_push(struct outq *q, struct msgbuf *b, const struct outq_limits *lim);
+
+// Queue len bytes of f from offset start (taking a new reference). File
+// ranges take no memory, so they are neither counted against the
+// watermarks nor dropped: a caller that queued a frame header can always
+// queue its payload. Returns 0, or -1 if the ring can't grow.
+int outq_push_file(struct outq *q, struct filebuf *f, off_t start, size_t len);
+
+// True if the oldest unwritten bytes are a file range. Such a range can
+// only be written by outq_flush(), not through outq_front().
+static inline int outq_head_file(const struct outq *q) {
+    return q->ring[q->head & (q->cap - 1)].file != NULL;
+}
+
+// The oldest unwritten bytes, for callers that write them some other way
+// (e.g. an io_uring send) and then report progress with outq_consume().
+static inline const char *outq_front(const struct outq *q, size_t *len) {
+    const struct outseg *seg = &q->ring[q->head & (q->cap - 1)];
+
+    *len = seg->len - seg->off;
+    return seg->buf->data + seg->off;
+}
+
+void outq_consume(struct outq *q, size_t n, const struct outq_limits *lim);
+
+// Queue b (taking a new reference) and try to write it immediately.
+// Returns 1 if everything was written, 0 if bytes remain queued and the
+// caller must wait for the socket to become writable, or -1 if the
+// connection failed or must be closed under OUTQ_CLOSE.
+int outq_send(struct outq *q, int fd, struct msgbuf *b, const struct outq_limits *lim);
+
+// Write as much as the socket accepts. Same return values as outq_send.
+int outq_flush(struct outq *q, int fd, const struct outq_limits *lim);
+
+// Let outq_flush() send writes of at least min bytes on fd with
+// MSG_ZEROCOPY. Returns 0, or -1 if the socket can't (the queue copies).
+int outq_zerocopy(struct outq *q, int fd, size_t min);
+
+// Make room to hold the buffers of a zero-copy send covering up to n
+// segments. Returns 0, or -1 if out of memory: the send must then copy,
+// since buffers it could not hold might be freed while still in use.
+int outq_zc_reserve(struct outq *q, unsigned n);
+
+// The next n bytes to be consumed were sent by zero-copy send zc_next;
+// hold their buffers until outq_zc_done() acknowledges it. Every
+// zero-copy send takes an id, even one that wrote nothing (n == 0), and
+// reserves room first.
+void outq_zc_hold(struct outq *q, size_t n);
+
+// Release the buffers of every zero-copy send up to and including id.
+// TCP completes sends in order, so the range's lower bound is not needed.
+void outq_zc_done(struct outq *q, uint32_t id);
+
+static inline int outq_zc_pending(const struct outq *q) {
+    return q->zc_head != q->zc_tail;
+}
+
+// Read zero-copy completions from fd's error queue, which epoll reports
+// as EPOLLERR. Returns 0, or -1 if the socket itself has failed.
+int outq_reap(struct outq *q, int fd);
+
+// Release every queued segment and the ring itself. Buffers of zero-copy
+// sends not yet reported done are held until they are: fd is shut down
+// and a duplicate of it kept, for outq_linger_reap() to read completions
+// from after the caller closes fd. fd is -1 if the queue never sent any.
+void outq_clear(struct outq *q, int fd);
+
+#define OUTQ_LINGER_MS  100     // how often outq_linger_reap() wants to run
+
+// Release the buffers of queues this thread cleared whose completions
+// have since arrived, or that waited too long. Returns how many are still
+// waiting; while any are, an event loop should call again within
+// OUTQ_LINGER_MS.
+int outq_linger_reap(void);
+
+#endif
@@ -0,0 +1,67 @@
+// pool.c
+#include <stdlib.h>
+#include "pool.h"
+
+#define POOL_ALIGN  16
+
+// Slab header, padded so the objects after it stay aligned.
+union slab {
+    union slab *next;
+    char pad[POOL_ALIGN];
+};
+
+void pool_init(struct pool *p, size_t size, unsigned per_slab) {
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    p->per_slab = per_slab ? per_slab : 1;
+    p->free = NULL;
+    p->slabs = NULL;
+    p->in_use = 0;
+}
+
+static int pool_grow(struct pool *p) {
+    union slab *s = malloc(sizeof(*s) + p->size * p->per_slab);
+    char *obj;
+
+    if (!s)
+        return -1;
+    s->next = p->slabs;
+    p->slabs = s;
+    obj = (char *)(s + 1);
+    for (unsigned i = 0; i < p->per_slab; i++, obj += p->size) {
+        *(void **)obj = p->free;
+        p->free = obj;
+    }
+    return 0;
+}
+
+void *pool_get(struct pool *p) {
+    void *obj;
+
+    if (!p->free && pool_grow(p) < 0)
+        return NULL;
+    obj = p->free;
+    p->free = *(void **)obj;
+    p->in_use++;
+    return obj;
+}
+
+void pool_put(struct pool *p, void *obj) {
+    *(void **)obj = p->free;
+    p->free = obj;
+    p->in_use--;
+}
+
+void pool_destroy(struct pool *p) {
+    union slab *s = p->slabs;
+
+    while (s) {
+        union slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    p->free = NULL;
+    p->slabs = NULL;
+    p->in_use = 0;
+}
@@ -0,0 +1,27 @@
+// pool.h
+// Fixed-size object pool (a simple slab allocator). Objects are carved
+// out of large slabs and recycled through a free list threaded through
+// the free objects themselves, so getting and putting one is a pointer
+// swap and live objects of one kind stay packed together. Slabs are only
+// returned by pool_destroy(). Not thread safe: give each thread its own.
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+struct pool {
+    size_t size;            // object size, rounded up for alignment
+    unsigned per_slab;
+    void *free;             // free list
+    void *slabs;            // every slab, linked through its header
+    unsigned long in_use;
+};
+
+void pool_init(struct pool *p, size_t size, unsigned per_slab);
+void pool_destroy(struct pool *p);
+
+// Returns an uninitialised object, or NULL if a new slab can't be had.
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+#endif
@@ -0,0 +1,136 @@
+// timer.c
+#include <time.h>
+#include "timer.h"
+
+#define TIMER_MASK  (TIMER_SLOTS - 1)
+
+uint64_t timer_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now) {
+    w->now = now;
+    w->count = 0;
+    for (int l = 0; l < TIMER_LEVELS; l++)
+        for (int s = 0; s < TIMER_SLOTS; s++)
+            w->slots[l][s] = 0;
+}
+
+// Link t into the slot for its deadline, relative to w->now.
+static void timer_link(struct timer_wheel *w, struct timer *t) {
+    uint64_t delta = t->expires - w->now;
+    struct timer **head;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_BITS * (level + 1)))
+        level++;
+    head = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void timer_unlink(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires) {
+    uint64_t max = w->now + ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+    if (timer_pending(t))
+        timer_unlink(t);
+    else
+        w->count++;
+    if (expires <= w->now)
+        expires = w->now + 1;
+    t->expires = expires < max ? expires : max;
+    timer_link(w, t);
+}
+
+void timer_del(struct timer_wheel *w, struct timer *t) {
+    if (!timer_pending(t))
+        return;
+    timer_unlink(t);
+    w->count--;
+}
+
+// Move every timer in a higher-level slot down to where it now belongs.
+static void timer_cascade(struct timer_wheel *w, int level) {
+    struct timer **head = &w->slots[level][(w->now >> (TIMER_BITS * level)) & TIMER_MASK];
+    struct timer *t = *head;
+
+    *head = 0;
+    while (t) {
+        struct timer *next = t->next;
+        timer_link(w, t);
+        t = next;
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now, timer_fn fn, void *ctx) {
+    // Nothing armed: skip straight to the present.
+    if (w->count == 0 && now > w->now)
+        w->now = now;
+
+    while (w->now < now) {
+        struct timer **head;
+        int level = 1;
+
+        w->now++;
+        // Highest level first, so timers can fall through several levels
+        // on the tick where the wheels below all wrap together.
+        while (level < TIMER_LEVELS && (w->now & (((uint64_t)1 << (TIMER_BITS * level)) - 1)) == 0)
+            level++;
+        while (--level > 0)
+            timer_cascade(w, level);
+
+        head = &w->slots[0][w->now & TIMER_MASK];
+        while (*head) {
+            struct timer *t = *head;
+            timer_unlink(t);
+            w->count--;
+            fn(t, ctx);
+        }
+    }
+}
+
+static void earliest(uint64_t *next, uint64_t when) {
+    if (*next == 0 || when < *next)
+        *next = when;
+}
+
+enum timer_action conn_timer_check(const struct conn_timer *ct, const struct timeouts *to,
+                                   uint64_t now, uint64_t *next) {
+    uint64_t last = ct->last_rx > ct->last_tx ? ct->last_rx : ct->last_tx;
+
+    *next = 0;
+    if (to->idle && now >= ct->last_rx + to->idle)
+        return TIMER_IDLE;
+    if (to->write && ct->tx_since && now >= ct->tx_since + to->write)
+        return TIMER_WRITE;
+
+    if (to->idle)
+        earliest(next, ct->last_rx + to->idle);
+    if (to->write && ct->tx_since)
+        earliest(next, ct->tx_since + to->write);
+    if (to->keepalive) {
+        if (now >= last + to->keepalive) {
+            // The caller pings now, so the next one is due a full
+            // interval from here.
+            earliest(next, now + to->keepalive);
+            return TIMER_PING;
+        }
+        earliest(next, last + to->keepalive);
+    }
+    return *next ? TIMER_REARM : TIMER_NONE;
+}
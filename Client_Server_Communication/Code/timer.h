@@ -0,0 +1,85 @@
+// timer.h
+// Hierarchical timing wheel for per-connection deadlines.
+//
+// Time is counted in ticks of TIMER_TICK_MS. Level 0 has one slot per
+// tick; every level above covers TIMER_SLOTS times the span of the one
+// below, and its timers cascade down a level each time the lower wheel
+// wraps. Arming and cancelling are O(1) list operations on a timer
+// embedded in the connection, so 100k connections need neither a heap
+// entry nor a system call each; the owning loop just wakes once a tick.
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS  100
+#define TIMER_BITS     6
+#define TIMER_SLOTS    (1 << TIMER_BITS)
+#define TIMER_LEVELS   4    // 64^4 ticks, about 19 days at 100 ms
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;   // NULL while not armed
+    uint64_t expires;       // tick
+};
+
+struct timer_wheel {
+    uint64_t now;           // last tick processed
+    unsigned long count;    // armed timers
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+typedef void (*timer_fn)(struct timer *t, void *ctx);
+
+// The structure a timer is embedded in.
+#define timer_entry(t, type, member) ((type *)((char *)(t) - offsetof(type, member)))
+
+// The current tick on CLOCK_MONOTONIC.
+uint64_t timer_now(void);
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+// Arm (or re-arm) t to fire at tick expires, never earlier than the next
+// tick. Deadlines beyond the wheel's range are clamped to its end.
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_del(struct timer_wheel *w, struct timer *t);
+
+static inline int timer_pending(const struct timer *t) {
+    return t->pprev != 0;
+}
+
+// Process every tick up to now, calling fn for each timer that expires.
+// The timer is disarmed before fn runs, so fn may re-arm or free it.
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now, timer_fn fn, void *ctx);
+
+// Connection deadlines in ticks; 0 disables one.
+struct timeouts {
+    uint64_t idle;          // close after this long without input
+    uint64_t keepalive;     // ping after this long without traffic either way
+    uint64_t write;         // close if queued output makes no progress for this long
+};
+
+static inline int timeouts_enabled(const struct timeouts *to) {
+    return to->idle || to->keepalive || to->write;
+}
+
+// Activity stamps for one connection. The hot path only writes these;
+// the timer is armed for the earliest deadline and re-checks them when it
+// fires, so traffic never has to move the timer.
+struct conn_timer {
+    struct timer timer;
+    uint64_t last_rx;       // tick of the last input
+    uint64_t last_tx;       // tick of the last frame queued
+    uint64_t tx_since;      // tick output has been stuck since, 0 if none
+};
+
+enum timer_action { TIMER_REARM, TIMER_PING, TIMER_IDLE, TIMER_WRITE, TIMER_NONE };
+
+// Decide what a fired timer means at tick now. For TIMER_REARM (and after
+// the caller sends a ping) *next holds the tick to re-arm for;
+// TIMER_NONE means no deadline is enabled.
+enum timer_action conn_timer_check(const struct conn_timer *ct, const struct timeouts *to,
+                                   uint64_t now, uint64_t *next);
+
+#endif
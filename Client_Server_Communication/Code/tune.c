@@ -0,0 +1,63 @@
+// tune.c
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "tune.h"
+
+static const char *const names[TUNE_PROFILES] = { "default", "latency", "throughput" };
+
+int tune_parse(const char *name, enum tune_profile *p) {
+    for (int i = 0; i < TUNE_PROFILES; i++)
+        if (strcmp(name, names[i]) == 0) {
+            *p = (enum tune_profile)i;
+            return 0;
+        }
+    return -1;
+}
+
+const char *tune_name(enum tune_profile p) {
+    return names[p];
+}
+
+static void set_int(int fd, int level, int opt, int val) {
+    setsockopt(fd, level, opt, &val, sizeof(val));
+}
+
+void tune_socket(int fd, enum tune_profile p) {
+    switch (p) {
+    case TUNE_LATENCY:
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+        set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+        set_int(fd, SOL_SOCKET, SO_BUSY_POLL, TUNE_BUSY_POLL_US);
+        break;
+    case TUNE_THROUGHPUT:
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, TUNE_BUF_BYTES);
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, TUNE_BUF_BYTES);
+        break;
+    default:
+        break;
+    }
+}
+
+void tune_after_read(int fd, enum tune_profile p) {
+    if (p == TUNE_LATENCY)
+        set_int(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+}
+
+void tune_cork(int fd, enum tune_profile p, int on) {
+    if (p == TUNE_THROUGHPUT)
+        set_int(fd, IPPROTO_TCP, TCP_CORK, on);
+}
+
+int tune_listen(int fd, const struct listen_opts *o) {
+    if (o->defer_secs > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &o->defer_secs, sizeof(o->defer_secs)) < 0)
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    // Server side TFO also needs bit 2 of net.ipv4.tcp_fastopen.
+    if (o->fastopen > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &o->fastopen, sizeof(o->fastopen)) < 0)
+        perror("setsockopt TCP_FASTOPEN");
+    return listen(fd, o->backlog);
+}
@@ -0,0 +1,48 @@
+// tune.h
+// Socket tuning profiles. The defaults favour neither latency nor
+// throughput; a profile picks one and sets the options that trade for it.
+#ifndef TUNE_H
+#define TUNE_H
+
+enum tune_profile {
+    TUNE_DEFAULT,       // kernel defaults, nothing is set
+    TUNE_LATENCY,       // no Nagle, immediate ACKs, busy polling
+    TUNE_THROUGHPUT,    // large buffers, corked batches
+    TUNE_PROFILES
+};
+
+#define TUNE_BUSY_POLL_US  50
+#define TUNE_BUF_BYTES     (4 << 20)
+
+// Look up a profile by name. Returns -1 for an unknown name.
+int tune_parse(const char *name, enum tune_profile *p);
+const char *tune_name(enum tune_profile p);
+
+// Set the profile's options on fd. Buffer sizes only take full effect
+// before listen() or connect(), and accepted sockets inherit every one of
+// these options, so a server need only tune its listener. Failures (e.g.
+// SO_BUSY_POLL above net.core.busy_read without CAP_NET_ADMIN) are ignored.
+void tune_socket(int fd, enum tune_profile p);
+
+// TCP_QUICKACK is cleared by the kernel as soon as it decides to delay
+// an ACK again, so the latency profile re-arms it after every read.
+void tune_after_read(int fd, enum tune_profile p);
+
+// Under the throughput profile, cork fd while a batch of replies is
+// written so that they leave in full segments, and uncork it afterwards.
+void tune_cork(int fd, enum tune_profile p, int on);
+
+// Listener settings for reconnect storms (-b, -A, -F).
+struct listen_opts {
+    int backlog;        // accept queue; the kernel caps it at net.core.somaxconn
+    int defer_secs;     // TCP_DEFER_ACCEPT: only wake for connections that
+                        // have sent data, or after this long; 0 = off
+    int fastopen;       // TCP_FASTOPEN: pending data-in-SYN requests; 0 = off
+};
+
+// Set the optional socket options on a bound socket and listen() on it.
+// An option the kernel refuses is reported and skipped; the result is
+// that of listen().
+int tune_listen(int fd, const struct listen_opts *o);
+
+#endif
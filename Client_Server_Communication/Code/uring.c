@@ -0,0 +1,208 @@
+// uring.c
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+int uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(u, 0, sizeof(*u));
+
+    // Multishot accept/recv can produce many CQEs per SQE, so size the
+    // completion queue generously. Fall back to plain setup on old kernels.
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 8;
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size)
+            u->sq_size = u->cq_size;
+        u->cq_size = u->sq_size;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = u->sq_ptr;
+    cq = u->cq_ptr;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+
+    // The index array is an identity map; SQEs are consumed in order.
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        u->sq_array[i] = i;
+    return 0;
+
+fail:
+    uring_exit(u);
+    return -1;
+}
+
+void uring_exit(struct uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_size);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+}
+
+static unsigned uring_flush(struct uring *u) {
+    unsigned pending = u->sqe_tail - *u->sq_tail;
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    return pending;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (u->sqe_tail - head >= u->sq_entries) {
+        // The kernel may take some SQEs even when the call fails (EBUSY
+        // while completions overflow), so the head decides, not the result.
+        uring_submit_and_wait(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail - head >= u->sq_entries)
+            return NULL;
+    }
+
+    sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    u->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(struct uring *u, unsigned wait_nr) {
+    unsigned pending = uring_flush(u);
+    int ret;
+
+    do {
+        u->enters++;
+        ret = sys_enter(u->fd, pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u) {
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_bufs(struct uring *u, struct uring_bufs *b, unsigned short bgid,
+                     unsigned entries, unsigned buf_size) {
+    struct io_uring_buf_reg reg;
+
+    memset(b, 0, sizeof(*b));
+    b->entries = entries;       // must be a power of two
+    b->buf_size = buf_size;
+    b->bgid = bgid;
+    b->ring_size = entries * sizeof(struct io_uring_buf);
+
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED)
+        return -1;
+    b->base = malloc((size_t)entries * buf_size);
+    if (!b->base) {
+        munmap(b->ring, b->ring_size);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_free_bufs(u, b);
+        return -1;
+    }
+
+    b->ring->tail = 0;
+    for (unsigned i = 0; i < entries; i++)
+        uring_recycle_buf(b, i);
+    return 0;
+}
+
+void uring_free_bufs(struct uring *u, struct uring_bufs *b) {
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    sys_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    if (b->ring && b->ring != MAP_FAILED)
+        munmap(b->ring, b->ring_size);
+    free(b->base);
+    b->ring = NULL;
+    b->base = NULL;
+}
+
+void uring_recycle_buf(struct uring_bufs *b, unsigned short bid) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->entries - 1)];
+
+    buf->addr = (unsigned long)uring_buf(b, bid);
+    buf->len = b->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&b->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,56 @@
+// uring.h
+// Minimal io_uring wrapper over the raw system calls (no liburing).
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;          // local tail, published on submit
+    unsigned long enters;       // io_uring_enter calls, for syscall accounting
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+};
+
+// A provided buffer ring: the kernel picks a buffer per completion and
+// reports its id in the CQE flags; the application hands it back after use.
+struct uring_bufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned entries;
+    unsigned buf_size;
+    unsigned short bgid;
+    size_t ring_size;
+};
+
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+
+// Returns a zeroed SQE. Pending SQEs are submitted if the ring is full;
+// NULL if the kernel took none of them, so no SQE could be freed.
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+
+// Submit every queued SQE and wait for at least wait_nr completions,
+// all in a single io_uring_enter call.
+int uring_submit_and_wait(struct uring *u, unsigned wait_nr);
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+int uring_setup_bufs(struct uring *u, struct uring_bufs *b, unsigned short bgid,
+                     unsigned entries, unsigned buf_size);
+void uring_free_bufs(struct uring *u, struct uring_bufs *b);
+void uring_recycle_buf(struct uring_bufs *b, unsigned short bid);
+
+static inline char *uring_buf(struct uring_bufs *b, unsigned short bid) {
+    return b->base + (size_t)bid * b->buf_size;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "clients.h"
+
+#define LIST_HEAD "Active clients: "
+#define ID_DIGITS 11    // an int in decimal, and the space after it
+
+static uint64_t *active;        // bit id is set while client id is connected
+static size_t words;
+static int count;
+
+// The set changes version on every connect and disconnect; the LIST
+// reply records the version it was built for.
+static unsigned long version = 1, built;
+static char *reply;
+static size_t reply_len, reply_cap;
+
+/*-------------------------------------------------
+ * Function: client_joined
+ *-------------------------------------------------*/
+int client_joined(int id) {
+    size_t w = (size_t)id / 64;
+
+    if (id < 0) return 0;
+    if (w >= words) {
+        size_t n = words ? words : 1;
+        uint64_t *grown;
+
+        while (n <= w) n *= 2;
+        if (!(grown = realloc(active, n * sizeof(*active))))
+            return -1;
+        memset(grown + words, 0, (n - words) * sizeof(*active));
+        active = grown;
+        words = n;
+    }
+    if (!(active[w] & (1ULL << (id % 64)))) {
+        active[w] |= 1ULL << (id % 64);
+        count++;
+        version++;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------
+ * Function: client_left
+ *-------------------------------------------------*/
+void client_left(int id) {
+    size_t w = (size_t)id / 64;
+
+    if (id < 0 || w >= words || !(active[w] & (1ULL << (id % 64)))) return;
+    active[w] &= ~(1ULL << (id % 64));
+    count--;
+    version++;
+}
+
+// Write id and a space at p; returns the length.
+static size_t put_id(char *p, unsigned id) {
+    char digits[ID_DIGITS];
+    size_t n = 0, len;
+
+    do {
+        digits[n++] = '0' + id % 10;
+        id /= 10;
+    } while (id);
+    len = n;
+    while (n) *p++ = digits[--n];
+    *p = ' ';
+    return len + 1;
+}
+
+/*-------------------------------------------------
+ * Function: client_list
+ *-------------------------------------------------*/
+const char *client_list(size_t *len) {
+    if (built != version) {
+        size_t need = sizeof(LIST_HEAD) + (size_t)count * ID_DIGITS + 1, pos;
+
+        if (need > reply_cap) {
+            char *grown = realloc(reply, need);
+            if (!grown)
+                return NULL;
+            reply = grown;
+            reply_cap = need;
+        }
+        memcpy(reply, LIST_HEAD, sizeof(LIST_HEAD) - 1);
+        pos = sizeof(LIST_HEAD) - 1;
+        // Only the words with someone in them, a set bit at a time.
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = active[w]; bits; bits &= bits - 1)
+                pos += put_id(reply + pos, (unsigned)(w * 64 + __builtin_ctzll(bits)));
+        }
+        reply[pos++] = '\n';
+        reply[pos] = '\0';
+        reply_len = pos;
+        built = version;
+    }
+    *len = reply_len;
+    return reply;
+}
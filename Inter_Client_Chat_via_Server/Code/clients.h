@@ -0,0 +1,22 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stddef.h>
+
+// The set of connected clients, kept as a bitmap over client ids, and
+// the reply to LIST that lists them. The reply is only rebuilt after a
+// connect or disconnect, so a LIST costs no formatting however many
+// clients there are, and it has no size limit.
+
+// Client id has connected / disconnected. Ids may be any int >= 0.
+// Call these wherever valid_ids[id] is set or reset: server.c's accept
+// and close paths, and the send-error path in server_helper.c.
+// client_joined returns 0, or -1 if the bitmap could not grow.
+int client_joined(int id);
+void client_left(int id);
+
+// "Active clients: 0 3 7 \n" for the current set, NUL-terminated, and
+// its length without the NUL. NULL if memory for it ran out.
+const char *client_list(size_t *len);
+
+#endif
@@ -0,0 +1,91 @@
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include "command.h"
+
+static int is_space(char c) {
+    return isspace((unsigned char)c);
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/*-------------------------------------------------
+ * Function: command_parse
+ *-------------------------------------------------*/
+enum command_type command_parse(const char *msg, size_t len, struct command *cmd) {
+    const char *p = msg, *end = msg + strnlen(msg, len), *colon;
+    long n = 0;
+
+    memset(cmd, 0, sizeof(*cmd));
+    while (p < end && *p == ' ') p++; // trim spaces
+
+    if (end - p >= 4 && memcmp(p, "LIST", 4) == 0)
+        return cmd->type = CMD_LIST;
+    if (end - p < 5 || memcmp(p, "DATA", 4) != 0 || !is_space(p[4]))
+        return cmd->type = CMD_UNKNOWN;
+
+    cmd->type = CMD_INVALID;
+    p += 5;
+    while (p < end && is_space(*p)) p++;
+
+    // N: the number of ids that follow.
+    if (p == end || !is_digit(*p)) {
+        cmd->error = memchr(p, ':', end - p) ? "ERROR: DATA needs a recipient count\n"
+                                             : "ERROR: DATA missing ':'\n";
+        return cmd->type;
+    }
+    for (; p < end && is_digit(*p); p++)
+        n = n > (LONG_MAX - 9) / 10 ? LONG_MAX : n * 10 + (*p - '0');
+    if (p < end && *p != ':' && !is_space(*p)) {
+        cmd->error = "ERROR: DATA needs a recipient count\n";
+        return cmd->type;
+    }
+
+    // The ids run up to the ':'. Only the first N count, and they are
+    // split and checked as they are handed out, so this only finds where
+    // they end.
+    if (!(colon = memchr(p, ':', end - p))) {
+        cmd->error = "ERROR: DATA missing ':'\n";
+        return cmd->type;
+    }
+    cmd->to.next = p;
+    cmd->to.end = colon;
+    cmd->to.left = n;
+
+    for (p = colon + 1; p < end && is_space(*p); p++)
+        ;
+    cmd->body = p;
+    cmd->body_len = end - p;
+    return cmd->type = CMD_DATA;
+}
+
+/*-------------------------------------------------
+ * Function: recipients_next
+ *-------------------------------------------------*/
+int recipients_next(struct recipients *r, int *id, const char **tok, size_t *tok_len) {
+    const char *p = r->next;
+    long v = 0;
+
+    if (r->left == 0)
+        return 0;
+    while (p < r->end && is_space(*p)) p++;
+    if (p == r->end) {
+        r->left = 0;    // fewer than N were given
+        return 0;
+    }
+    *tok = p;
+    while (p < r->end && !is_space(*p)) {
+        if (!is_digit(*p) || v > (INT_MAX - (*p - '0')) / 10)
+            v = -1;
+        else if (v >= 0)
+            v = v * 10 + (*p - '0');
+        p++;
+    }
+    *tok_len = p - *tok;
+    *id = (int)v;
+    r->next = p;
+    r->left--;
+    return 1;
+}
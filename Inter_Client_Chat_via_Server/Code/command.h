@@ -0,0 +1,46 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+// Client commands:
+//   LIST
+//   DATA <N> id1 id2 ... idN: message
+//
+// command_parse() reads a command without modifying or copying it. The
+// recipients of a DATA are returned as a span of the input, found with a
+// memchr for the ':', so a message can name any number of them;
+// recipients_next() splits and converts them one at a time, which is the
+// only pass over the ids themselves.
+
+enum command_type {
+    CMD_LIST,
+    CMD_DATA,
+    CMD_INVALID,    // a DATA that can't be sent; error says why
+    CMD_UNKNOWN,
+};
+
+// The unread part of a DATA recipient list.
+struct recipients {
+    const char *next, *end;
+    long left;      // ids still to hand out
+};
+
+struct command {
+    enum command_type type;
+    struct recipients to;       // CMD_DATA
+    const char *body;           // CMD_DATA: after ':' and any spaces
+    size_t body_len;
+    const char *error;          // CMD_INVALID: reply for the client
+};
+
+// Parse the first len bytes of msg, stopping early at a NUL. Pointers in
+// cmd point into msg. Returns cmd->type.
+enum command_type command_parse(const char *msg, size_t len, struct command *cmd);
+
+// Take the next recipient. Returns 1 with *id set, or with *id = -1 if
+// the token is not a number that fits an int; tok and tok_len give its
+// text either way. Returns 0 once N ids, or all that were given, are taken.
+int recipients_next(struct recipients *r, int *id, const char **tok, size_t *tok_len);
+
+#endif
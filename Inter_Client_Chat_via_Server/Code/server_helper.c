@@ -6,95 +6,136 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include "server.h"
+#include "clients.h"
+#include "command.h"
 
 // DO NOT define client_socks or valid_ids here!
 // They are defined in server.c
 
 /*-------------------------------------------------
- * Function: send_message
+ * Fan-out: one message, many recipients
  *-------------------------------------------------*/
-void send_message(char *msg, int len, int dst_id, int src_id) {
-    assert(dst_id < MAX_CLIENTS);
-    if (client_socks[dst_id] == INVALID_FD) return;
 
-    char buf[MAX_BUF_SIZE];
+// A message as it goes on the wire: "server: " or "client-<id>: ", the
+// text, and a NUL. The prefix is formatted once and the same three
+// iovecs are written to every recipient; the text is sent from where
+// it already is, never copied.
+struct fanout {
+    char prefix[32];
+    struct iovec iov[3];
+};
+
+// Send exactly len bytes of text, however many that is.
+static void fanout_prepare_len(struct fanout *f, const char *msg, size_t len, int src_id) {
+    int n;
+
     if (src_id == SERVER_ID) {
-        snprintf(buf, sizeof(buf), "server: %s", msg);
+        n = snprintf(f->prefix, sizeof(f->prefix), "server: ");
     } else {
-        snprintf(buf, sizeof(buf), "client-%d: %s", src_id, msg);
+        n = snprintf(f->prefix, sizeof(f->prefix), "client-%d: ", src_id);
     }
+    f->iov[0].iov_base = f->prefix;
+    f->iov[0].iov_len = n;
+    f->iov[1].iov_base = (char *)msg;
+    f->iov[1].iov_len = len;
+    f->iov[2].iov_base = (char *)"";
+    f->iov[2].iov_len = 1;
+}
+
+// len may count the text's NUL or not; the NUL is always sent once.
+static void fanout_prepare(struct fanout *f, const char *msg, int len, int src_id) {
+    size_t max;
+
+    if (len > 0 && msg[len - 1] == '\0')
+        len--;
+    fanout_prepare_len(f, msg, len > 0 ? (size_t)len : 0, src_id);
+    // As before, the whole message including its NUL fits in MAX_BUF_SIZE.
+    max = MAX_BUF_SIZE - 1 - f->iov[0].iov_len;
+    if (f->iov[1].iov_len > max)
+        f->iov[1].iov_len = max;
+}
 
-    if (send(client_socks[dst_id], buf, strlen(buf) + 1, 0) < 0) {
+static void fanout_send(struct fanout *f, int dst_id) {
+    struct msghdr mh = { 0 };
+
+    assert(dst_id < MAX_CLIENTS);
+    if (client_socks[dst_id] == INVALID_FD) return;
+
+    mh.msg_iov = f->iov;
+    mh.msg_iovlen = 3;
+    if (sendmsg(client_socks[dst_id], &mh, 0) < 0) {
         perror("send error");
         close(client_socks[dst_id]);
         client_socks[dst_id] = INVALID_FD;
         valid_ids[dst_id] = INVALID_ID;
+        client_left(dst_id);
     }
 }
 
+/*-------------------------------------------------
+ * Function: send_message
+ *-------------------------------------------------*/
+// msg is sent up to its NUL, as it always was; len is not relied on,
+// since callers in server.c pass strlen(msg) or strlen(msg) + 1 alike.
+void send_message(char *msg, int len, int dst_id, int src_id) {
+    struct fanout f;
+
+    (void)len;
+    fanout_prepare(&f, msg, (int)strlen(msg), src_id);
+    fanout_send(&f, dst_id);
+}
+
 /*-------------------------------------------------
  * Function: recv_message
  *-------------------------------------------------*/
 void recv_message(char *msg, int len, int client_id, int *valid_ids_local, int num_clients) {
-      printf("DEBUG: Server received from client %d: '%s'\n", client_id, msg);
-    while (*msg == ' ') msg++; // trim spaces
-
-    if (strncmp(msg, "LIST", 4) == 0) {
-        char response[1024];
-        int pos = snprintf(response, sizeof(response), "Active clients: ");
-        for (int i = 0; i < num_clients; i++) {
-            if (valid_ids_local[i] != INVALID_ID) {
-                pos += snprintf(response + pos, sizeof(response) - pos, "%d ", i);
-            }
-        }
-        snprintf(response + pos, sizeof(response) - pos, "\n");
-        send_message(response, strlen(response) + 1, client_id, SERVER_ID);
-        printf("client %d requested LIST -> sent list: %s\n", client_id, response);
-        return;
-    }
+    struct command cmd;
+
+    switch (command_parse(msg, len, &cmd)) {
+    case CMD_LIST: {
+        // Built after the last connect or disconnect, not per request.
+        size_t list_len;
+        const char *list = client_list(&list_len);
+        struct fanout out;
 
-    if (strncmp(msg, "DATA", 4) == 0 && isspace((unsigned char)msg[4])) {
-        char *colon = strchr(msg, ':');
-        if (!colon) {
-            char err[] = "ERROR: DATA missing ':'\n";
+        if (!list) {
+            char err[] = "ERROR: LIST unavailable, out of memory\n";
             send_message(err, strlen(err), client_id, SERVER_ID);
             return;
         }
+        fanout_prepare_len(&out, list, list_len, SERVER_ID);
+        fanout_send(&out, client_id);
+        printf("client %d requested LIST -> sent %zu-byte list\n", client_id, list_len);
+        return;
+    }
 
-        *colon = '\0';
-        char *body = colon + 1;
-        while (*body && isspace((unsigned char)*body)) body++;
-
-        int num_receivers = 0;
-        int ids[100];
-        char *token = strtok(msg + 5, " ");
-        if (!token) return;
-        num_receivers = atoi(token);
-
-        for (int i = 0; i < num_receivers; i++) {
-            token = strtok(NULL, " ");
-            if (!token) break;
-            ids[i] = atoi(token);
-        }
-
-        int sent_count = 0;
+    case CMD_DATA: {
+        // The body runs to the end of msg, so it is still NUL-terminated.
+        char *body = (char *)cmd.body;
+        struct fanout out;
+        int sent_count = 0, dst;
         char invalid_ids[256] = "";
-        for (int i = 0; i < num_receivers; i++) {
-            int dst = ids[i];
+        size_t invalid_len = 0;
+        const char *tok;
+        size_t tok_len;
+
+        // Formatted once, however many recipients there are.
+        fanout_prepare(&out, body, (int)cmd.body_len, client_id);
+        while (recipients_next(&cmd.to, &dst, &tok, &tok_len)) {
             if (dst >= 0 && dst < num_clients && valid_ids_local[dst] != INVALID_ID) {
-                send_message(body, strlen(body) + 1, dst, client_id);
+                fanout_send(&out, dst);
                 sent_count++;
-            } else {
-                char tmp[16];
-                snprintf(tmp, sizeof(tmp), " %d", dst);
-                strncat(invalid_ids, tmp, sizeof(invalid_ids) - strlen(invalid_ids) - 1);
+            } else if (invalid_len + tok_len + 2 < sizeof(invalid_ids)) {
+                invalid_len += snprintf(invalid_ids + invalid_len, sizeof(invalid_ids) - invalid_len,
+                                        " %.*s", (int)tok_len, tok);
             }
         }
 
         char ack[256];
-        if (strlen(invalid_ids) == 0)
+        if (invalid_len == 0)
             snprintf(ack, sizeof(ack), "Sent to %d recipient(s)\n", sent_count);
         else
             snprintf(ack, sizeof(ack), "Sent to %d recipient(s); invalid ids:%s\n", sent_count, invalid_ids);
@@ -104,8 +145,15 @@ void recv_message(char *msg, int len, int client_id, int *valid_ids_local, int n
         return;
     }
 
+    case CMD_INVALID:
+        send_message((char *)cmd.error, strlen(cmd.error), client_id, SERVER_ID);
+        return;
+
+    case CMD_UNKNOWN:
+        break;
+    }
+
     char err[] = "ERROR: unknown command. Use LIST or DATA <N> ids...: message\n";
     send_message(err, strlen(err), client_id, SERVER_ID);
     printf("client %d sent unrecognized message: %s\n", client_id, msg);
 }
-